@@ -1,155 +1,1127 @@
 #include <iostream>
 #include <fstream>
+#include <cstring>
 #include <vector>
 #include <string>
-#include <unordered_map>
 #include <algorithm>
 #include <cctype>
-#include <unordered_set>
+#include <climits>
+#include <cstdlib>
+#include <cmath>
+#include <queue>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// Сегмент обратного индекса, отображённый в память (формат v7, см.
+// save_inverted в indexer/main.cpp): фронт-кодированный словарь из
+// блоков по DICT_BLOCK термов с таблицей смещений блоков + секции
+// скипов и постингов, сжатых дельта+варинт кодированием; файл
+// читается прямо из страничного кэша, списки распаковываются при
+// обращении
+struct InvertedIndex {
+    const char* base = nullptr;
+    size_t file_size = 0;
+    long long term_count = 0;
+    int block_count = 0;
+    const long long* block_offsets = nullptr;
+    long long skips_start = 0;    // база относительных смещений скипов
+    long long postings_start = 0; // база относительных смещений постингов
+    bool has_positions = false;   // после tf каждого постинга идут позиции
+};
+
+const int DICT_BLOCK = 16;
 
-struct DocNode {
-    int doc_id;
-    DocNode* next;
+// Скип-запись: последний doc_id блока из SKIP_BLOCK постингов,
+// байтовое смещение блока от начала списка и максимальный tf блока
+// (поблочная верхняя граница вклада терма для WAND)
+struct SkipEntry {
+    int last_doc;
+    int offset;
+    int max_tf;
 };
 
-struct TermEntry {
-    std::string term;
-    long long freq;
-    int doc_count;
-    DocNode* docs;
+const int SKIP_BLOCK = 128;
+
+// Словарная запись терма внутри отображённого файла
+struct TermInfo {
+    bool found = false;
+    long long freq = 0;
+    int doc_count = 0;
+    int max_tf = 0; // максимальный tf терма — верхняя граница для WAND
+    const unsigned char* postings = nullptr; // дельта+варинт кодированный список
+    int postings_bytes = 0;
+    const SkipEntry* skips = nullptr; // скипы длинных списков
+    int skip_count = 0;
+    bool has_positions = false; // сегмент версии 6 с позициями токенов
+};
 
-    ~TermEntry() {
-        DocNode* n = docs;
-        while (n) {
-            DocNode* next = n->next;
-            delete n;
-            n = next;
+// Постинги терма по всем сегментам индекса; сегменты покрывают
+// непересекающиеся возрастающие диапазоны doc_id в порядке манифеста
+struct TermPostings {
+    bool found = false;
+    long long freq = 0;
+    int doc_count = 0;
+    std::vector<TermInfo> parts; // по одной записи на сегмент с термом
+};
+
+std::vector<std::string> documents;
+std::vector<InvertedIndex> segments_;
+
+const char* MANIFEST_FILE = "segments.idx";
+
+// Инструментирование задержек: время каждого запроса раскладывается
+// на разбор, чтение постингов, операции над множествами и
+// форматирование, и копится в гистограммах с логарифмическими
+// корзинами (в духе HDR) — перцентили восстанавливаются по корзинам
+// без хранения отдельных замеров. Счётчики атомарные, так что воркеры
+// сервера пишут в общие гистограммы без блокировок
+struct LatencyHistogram {
+    static const int BUCKETS = 40; // корзина i покрывает [2^i, 2^(i+1)) мкс
+
+    std::atomic<long long> counts[BUCKETS] = {};
+    std::atomic<long long> total{0};
+    std::atomic<long long> max_us{0};
+
+    void record(long long us) {
+        if (us < 0) us = 0;
+        int bucket = 0;
+        while ((1LL << (bucket + 1)) <= us && bucket + 1 < BUCKETS) bucket++;
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        long long cur = max_us.load(std::memory_order_relaxed);
+        while (us > cur && !max_us.compare_exchange_weak(cur, us)) {}
+    }
+
+    // Верхняя граница корзины, в которую попадает перцентиль
+    long long percentile(double p) const {
+        long long n = total.load(std::memory_order_relaxed);
+        if (n == 0) return 0;
+        long long need = (long long)(n * p);
+        if (need < 1) need = 1;
+        long long seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= need) return 1LL << (i + 1);
         }
+        return max_us.load(std::memory_order_relaxed);
     }
 };
 
-std::vector<std::string> documents;
-std::unordered_map<std::string, TermEntry*> hash_table;
+LatencyHistogram hist_total, hist_parse, hist_fetch, hist_setop, hist_format;
 
-void load_forward(const char* fn) {
-    std::ifstream in(fn, std::ios::binary);
-    if (!in) {
-        std::cerr << "Cannot open forward index file\n";
-        return;
+// Счётчики стадий текущего запроса; у каждого воркера свои
+struct QueryTimings {
+    long long fetch = 0;
+    long long setop = 0;
+    long long format = 0;
+};
+thread_local QueryTimings qt;
+
+inline long long now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Прибавляет время жизни области к счётчику стадии
+struct StageTimer {
+    long long& acc;
+    long long t0;
+    StageTimer(long long& a) : acc(a), t0(now_us()) {}
+    ~StageTimer() { acc += now_us() - t0; }
+};
+
+// Счётчики кэша распакованных постингов (сам кэш объявлен ниже)
+long long posting_cache_hits = 0;
+long long posting_cache_misses = 0;
+
+// Сводка задержек по стадиям (команда stats в серверном режиме,
+// дамп на выходе в консольном)
+void print_latency_stats(std::ostream& out) {
+    out << "Queries: " << hist_total.total.load() << "\n";
+    out << "Latency, microseconds (bucket upper bounds):\n";
+    struct { const char* name; const LatencyHistogram* h; } rows[] = {
+        {"total", &hist_total}, {"parse", &hist_parse}, {"fetch", &hist_fetch},
+        {"setop", &hist_setop}, {"format", &hist_format},
+    };
+    out << "stage     p50     p95     p99     max\n";
+    for (auto& row : rows) {
+        out << row.name;
+        for (size_t s = std::strlen(row.name); s < 7; ++s) out << ' ';
+        out << ' ' << row.h->percentile(0.50)
+            << '\t' << row.h->percentile(0.95)
+            << '\t' << row.h->percentile(0.99)
+            << '\t' << row.h->max_us.load() << "\n";
+    }
+    long long fetches = posting_cache_hits + posting_cache_misses;
+    if (fetches > 0) {
+        out << "Posting cache: " << posting_cache_hits << "/" << fetches
+            << " hits (" << 100.0 * posting_cache_hits / fetches << "%)\n";
+    }
+}
+
+// Имена сегментов из манифеста (пустой список — односегментный индекс)
+std::vector<std::string> read_manifest() {
+    std::vector<std::string> names;
+    std::ifstream in(MANIFEST_FILE);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) names.push_back(line);
+    }
+    return names;
+}
+
+// Разбор forward-образа из памяти (файл или секция снимка).
+// v2 начинается с магии "FIDX" и несёт alias после oid (ссылка
+// почти дубликата на канонический документ при --dedup);
+// старый формат начинается сразу с doc_count
+bool parse_forward(const char* p, const char* end) {
+    int version = 1;
+    if (end - p >= 8 && std::memcmp(p, "FIDX", 4) == 0) {
+        p += 4;
+        std::memcpy(&version, p, sizeof(int));
+        p += sizeof(int);
     }
 
     int doc_count;
-    in.read(reinterpret_cast<char*>(&doc_count), sizeof(int));
-    documents.resize(doc_count);
+    std::memcpy(&doc_count, p, sizeof(int));
+    p += sizeof(int);
 
-    for (int i = 0; i < doc_count; ++i) {
+    for (int i = 0; i < doc_count && p < end; ++i) {
         int l;
-        std::string title, url, oid;
+        std::string url;
 
         // title
-        in.read(reinterpret_cast<char*>(&l), sizeof(int));
-        title.resize(l);
-        in.read(title.data(), l);
+        std::memcpy(&l, p, sizeof(int));
+        p += sizeof(int) + l;
 
         // url
-        in.read(reinterpret_cast<char*>(&l), sizeof(int));
-        url.resize(l);
-        in.read(url.data(), l);
+        std::memcpy(&l, p, sizeof(int));
+        p += sizeof(int);
+        url.assign(p, l);
+        p += l;
 
         // oid
-        in.read(reinterpret_cast<char*>(&l), sizeof(int));
-        oid.resize(l);
-        in.read(oid.data(), l);
+        std::memcpy(&l, p, sizeof(int));
+        p += sizeof(int) + l;
+
+        if (version >= 2) {
+            // Дубликаты не встречаются в постингах, alias здесь
+            // только для полноты формата
+            p += sizeof(int);
+        }
 
-        documents[i] = url;
+        documents.push_back(std::move(url));
+    }
+    return true;
+}
+
+bool load_forward_file(const char* fn) {
+    std::ifstream in(fn, std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::cerr << "Cannot open forward index file: " << fn << "\n";
+        return false;
     }
 
+    size_t size = static_cast<size_t>(in.tellg());
+    in.seekg(0);
+    std::vector<char> buf(size);
+    in.read(buf.data(), size);
     in.close();
+    return parse_forward(buf.data(), buf.data() + size);
 }
 
-void load_inverted(const char* fn) {
-    std::ifstream in(fn, std::ios::binary);
-    if (!in) {
-        std::cerr << "Cannot open inverted index file\n";
-        return;
+// Инициализация сегмента из отображённого inverted-образа;
+// file_size > 0 означает собственный mmap, освобождаемый на выходе
+// (секция снимка живёт внутри общего отображения и имеет file_size 0)
+bool init_inverted(const char* base, size_t file_size, const char* name) {
+    InvertedIndex seg;
+    seg.base = base;
+    seg.file_size = file_size;
+
+    if (std::memcmp(seg.base, "IIDX", 4) != 0) {
+        std::cerr << "Unsupported inverted index format in " << name << "\n";
+        return false;
+    }
+
+    int version;
+    std::memcpy(&version, seg.base + 4, sizeof(int));
+    if (version != 8) {
+        std::cerr << "Unsupported inverted index version: " << version << "\n";
+        return false;
     }
 
-    long long total_terms;
-    in.read(reinterpret_cast<char*>(&total_terms), sizeof(long long));
+    int flags;
+    std::memcpy(&seg.term_count, seg.base + 8, sizeof(long long));
+    std::memcpy(&flags, seg.base + 16, sizeof(int));
+    std::memcpy(&seg.block_count, seg.base + 20, sizeof(int));
+    std::memcpy(&seg.skips_start, seg.base + 24, sizeof(long long));
+    std::memcpy(&seg.postings_start, seg.base + 32, sizeof(long long));
+    seg.block_offsets = reinterpret_cast<const long long*>(seg.base + 40);
+    seg.has_positions = (flags & 1);
+    segments_.push_back(seg);
+    return true;
+}
 
-    for (long long i = 0; i < total_terms; ++i) {
-        TermEntry* e = new TermEntry();
+bool load_inverted_file(const char* fn) {
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open inverted index file: " << fn << "\n";
+        return false;
+    }
 
-        in.read(reinterpret_cast<char*>(&e->freq), sizeof(long long));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 16) {
+        std::cerr << "Invalid inverted index file: " << fn << "\n";
+        close(fd);
+        return false;
+    }
 
-        int l;
-        in.read(reinterpret_cast<char*>(&l), sizeof(int));
-        e->term.resize(l);
-        in.read(e->term.data(), l);
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Cannot mmap inverted index file: " << fn << "\n";
+        return false;
+    }
+
+    return init_inverted(static_cast<const char*>(map), st.st_size, fn);
+}
+
+// Хранилище текстов документов (docstore.idx, пишется индексатором с
+// --store): очищенные тексты, сжатые блоками по ~64 КБ LZ-схемой в
+// духе LZ4 (см. compress_block в indexer/main.cpp). Для сниппета
+// распаковывается только блок нужного документа. Хранилище
+// опционально: без файла движок просто не показывает сниппеты
+struct DocStore {
+    struct DocEntry { int block; int offset; int length; };
+    struct BlockEntry { long long offset; int comp_bytes; int raw_bytes; };
+
+    const char* base = nullptr;
+    size_t file_size = 0;
+    int doc_count = 0;
+    int block_count = 0;
+    const DocEntry* docs = nullptr;
+    const BlockEntry* blocks = nullptr;
+};
+
+DocStore docstore;
+
+// Инициализация хранилища из отображённого образа; file_size > 0 —
+// собственный mmap, 0 — секция внутри общего отображения снимка
+bool init_docstore(const char* base, size_t file_size) {
+    int version;
+    std::memcpy(&version, base + 4, sizeof(int));
+    if (std::memcmp(base, "DSTR", 4) != 0 || version != 1) {
+        std::cerr << "Unsupported document store format\n";
+        return false;
+    }
+
+    docstore.base = base;
+    docstore.file_size = file_size;
+    std::memcpy(&docstore.doc_count, base + 8, sizeof(int));
+    std::memcpy(&docstore.block_count, base + 12, sizeof(int));
+    docstore.docs = reinterpret_cast<const DocStore::DocEntry*>(base + 16);
+    docstore.blocks = reinterpret_cast<const DocStore::BlockEntry*>(
+        base + 16 + (long long)docstore.doc_count * sizeof(DocStore::DocEntry));
+    return true;
+}
+
+bool load_docstore(const char* fn) {
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) return false; // хранилище не собирали — это нормально
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 16) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    if (!init_docstore(static_cast<const char*>(map), st.st_size)) {
+        munmap(map, st.st_size);
+        docstore = DocStore();
+        return false;
+    }
+    return true;
+}
+
+// Снимок одним файлом (snapshot.idx, пишется индексатором с
+// --snapshot): секции forward/inverted/zipf/docstore подряд, в конце
+// каталог секций и трейлер "SNAP". Файл отображается целиком, секции
+// разбираются теми же кодами, что и отдельные файлы
+const char* SNAPSHOT_FILE = "snapshot.idx";
+const char* snapshot_base = nullptr;
+size_t snapshot_size = 0;
+
+bool load_snapshot() {
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) return false; // снимка нет — обычные файлы
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 20) {
+        close(fd);
+        return false;
+    }
 
-        in.read(reinterpret_cast<char*>(&e->doc_count), sizeof(int));
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
 
-        e->docs = nullptr;
-        DocNode* last = nullptr;
-        for (int j = 0; j < e->doc_count; ++j) {
-            int doc_id;
-            in.read(reinterpret_cast<char*>(&doc_id), sizeof(int));
-            DocNode* node = new DocNode{doc_id, nullptr};
-            if (!e->docs) e->docs = node;
-            if (last) last->next = node;
-            last = node;
+    const char* base = static_cast<const char*>(map);
+    const char* end = base + st.st_size;
+
+    // Трейлер: dir_offset, section_count, version, "SNAP"
+    if (std::memcmp(end - 4, "SNAP", 4) != 0) {
+        std::cerr << "Bad snapshot trailer in " << SNAPSHOT_FILE << "\n";
+        munmap(map, st.st_size);
+        return false;
+    }
+    int version, section_count;
+    long long dir_offset;
+    std::memcpy(&version, end - 8, sizeof(int));
+    std::memcpy(&section_count, end - 12, sizeof(int));
+    std::memcpy(&dir_offset, end - 20, sizeof(long long));
+    if (version != 1) {
+        std::cerr << "Unsupported snapshot version: " << version << "\n";
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    snapshot_base = base;
+    snapshot_size = st.st_size;
+
+    const char* dir = base + dir_offset;
+    for (int i = 0; i < section_count; ++i) {
+        const char* tag = dir;
+        long long offset, length;
+        std::memcpy(&offset, dir + 4, sizeof(long long));
+        std::memcpy(&length, dir + 12, sizeof(long long));
+        dir += 4 + 2 * sizeof(long long);
+
+        if (std::memcmp(tag, "FWD ", 4) == 0) {
+            parse_forward(base + offset, base + offset + length);
+        } else if (std::memcmp(tag, "INV ", 4) == 0) {
+            if (!init_inverted(base + offset, 0, SNAPSHOT_FILE)) return false;
+        } else if (std::memcmp(tag, "DSTR", 4) == 0) {
+            init_docstore(base + offset, 0);
         }
+        // ZIPF и незнакомые секции движку не нужны
+    }
+    return true;
+}
 
-        hash_table[e->term] = e;
+// Загрузка индексов: сегменты из манифеста, единый снимок или
+// одиночные forward.idx / inverted.idx
+bool load_indexes() {
+    std::vector<std::string> names = read_manifest();
+    if (names.empty()) {
+        if (load_snapshot()) return true;
+        load_forward_file("forward.idx");
+        load_docstore("docstore.idx");
+        return load_inverted_file("inverted.idx");
     }
 
-    in.close();
+    // Для многосегментного индекса хранилище текстов не поддержано:
+    // docstore.idx пишется только полной пересборкой или шардированием
+
+    for (const auto& name : names) {
+        if (!load_forward_file((name + ".fwd").c_str()) ||
+            !load_inverted_file((name + ".inv").c_str())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Чтение варинта: младшие 7 бит в байте, старший бит — признак продолжения
+inline unsigned int read_varint(const unsigned char*& p) {
+    unsigned int v = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        v |= static_cast<unsigned int>(*p & 0x7F) << shift;
+        shift += 7;
+        p++;
+    }
+    v |= static_cast<unsigned int>(*p) << shift;
+    p++;
+    return v;
 }
 
-using DocList = std::unordered_set<int>;
+// Поиск терма в фронт-кодированном словаре сегмента: бинарный поиск
+// по первым термам блоков (они хранятся целиком), затем линейный
+// проход по блоку с восстановлением термов из общих префиксов
+TermInfo find_in_segment(const InvertedIndex& seg, const std::string& term) {
+    TermInfo info;
+    if (seg.block_count == 0) return info;
+
+    // Последний блок, чей первый терм <= искомого
+    long long lo = 0, hi = seg.block_count;
+    while (hi - lo > 1) {
+        long long mid = (lo + hi) / 2;
+        const unsigned char* p =
+            reinterpret_cast<const unsigned char*>(seg.base + seg.block_offsets[mid]);
+        read_varint(p); // префикс первого терма блока всегда 0
+        unsigned int len = read_varint(p);
+        int cmp = std::memcmp(p, term.data(), std::min((size_t)len, term.size()));
+        if (cmp == 0) cmp = (int)len - (int)term.size();
+        if (cmp <= 0) lo = mid;
+        else hi = mid;
+    }
 
-DocList get_docs_for_term(const std::string& term) {
-    DocList result;
-    auto it = hash_table.find(term);
-    if (it != hash_table.end()) {
-        DocNode* n = it->second->docs;
-        while (n) {
-            result.insert(n->doc_id);
-            n = n->next;
+    const unsigned char* p =
+        reinterpret_cast<const unsigned char*>(seg.base + seg.block_offsets[lo]);
+    long long count = std::min((long long)DICT_BLOCK,
+                               seg.term_count - lo * DICT_BLOCK);
+    std::string cur;
+    for (long long i = 0; i < count; ++i) {
+        unsigned int prefix = read_varint(p);
+        unsigned int suffix = read_varint(p);
+        cur.resize(prefix);
+        cur.append(reinterpret_cast<const char*>(p), suffix);
+        p += suffix;
+
+        if (cur == term) {
+            std::memcpy(&info.freq, p, sizeof(long long));
+            p += sizeof(long long);
+            std::memcpy(&info.doc_count, p, sizeof(int));
+            p += sizeof(int);
+            std::memcpy(&info.max_tf, p, sizeof(int));
+            p += sizeof(int);
+            long long postings_offset;
+            std::memcpy(&postings_offset, p, sizeof(long long));
+            p += sizeof(long long);
+            std::memcpy(&info.postings_bytes, p, sizeof(int));
+            p += sizeof(int);
+            long long skip_offset;
+            std::memcpy(&skip_offset, p, sizeof(long long));
+            p += sizeof(long long);
+            std::memcpy(&info.skip_count, p, sizeof(int));
+            info.postings = reinterpret_cast<const unsigned char*>(
+                seg.base + seg.postings_start + postings_offset);
+            info.skips = reinterpret_cast<const SkipEntry*>(
+                seg.base + seg.skips_start + skip_offset);
+            info.has_positions = seg.has_positions;
+            info.found = true;
+            return info;
+        }
+        if (cur > term) break; // словарь отсортирован — дальше не будет
+        p += 2 * sizeof(long long) + 3 * sizeof(int)
+           + sizeof(long long) + sizeof(int); // метаданные терма
+    }
+    return info;
+}
+
+// Поиск терма по всем сегментам с объединением статистик
+TermPostings find_term(const std::string& term) {
+    StageTimer timer(qt.fetch);
+    TermPostings result;
+    for (const auto& seg : segments_) {
+        TermInfo info = find_in_segment(seg, term);
+        if (info.found) {
+            result.found = true;
+            result.freq += info.freq;
+            result.doc_count += info.doc_count;
+            result.parts.push_back(info);
         }
     }
     return result;
 }
 
-DocList intersect(const DocList& a, const DocList& b) {
+// Предохранитель для подстановок: 'а*' раскрылась бы в пол-словаря,
+// ограничиваемся самыми частыми термами диапазона
+const size_t MAX_EXPAND = 256;
+
+// Термы сегмента с данным префиксом: словарь отсортирован, так что
+// это непрерывный диапазон — бинарный поиск по первым термам блоков,
+// затем последовательный проход до выхода за диапазон
+void collect_prefix_in_segment(const InvertedIndex& seg,
+                               const std::string& prefix,
+                               std::vector<std::string>& out) {
+    if (seg.block_count == 0) return;
+
+    // Последний блок, чей первый терм <= префикса
+    long long lo = 0, hi = seg.block_count;
+    while (hi - lo > 1) {
+        long long mid = (lo + hi) / 2;
+        const unsigned char* p =
+            reinterpret_cast<const unsigned char*>(seg.base + seg.block_offsets[mid]);
+        read_varint(p);
+        unsigned int len = read_varint(p);
+        int cmp = std::memcmp(p, prefix.data(), std::min((size_t)len, prefix.size()));
+        if (cmp == 0) cmp = (int)len - (int)prefix.size();
+        if (cmp <= 0) lo = mid;
+        else hi = mid;
+    }
+
+    const unsigned char* p =
+        reinterpret_cast<const unsigned char*>(seg.base + seg.block_offsets[lo]);
+    std::string cur;
+    for (long long i = lo * DICT_BLOCK; i < seg.term_count; ++i) {
+        unsigned int pre = read_varint(p);
+        unsigned int suffix = read_varint(p);
+        cur.resize(pre);
+        cur.append(reinterpret_cast<const char*>(p), suffix);
+        p += suffix;
+
+        int cmp = cur.compare(0, prefix.size(), prefix);
+        if (cmp > 0) break; // диапазон кончился — дальше термы больше
+        if (cmp == 0 && cur.size() >= prefix.size()) out.push_back(cur);
+        p += 2 * sizeof(long long) + 3 * sizeof(int)
+           + sizeof(long long) + sizeof(int); // метаданные терма
+    }
+}
+
+// Раскрытие подстановки 'префикс*' в отсортированный список термов
+// словаря (по всем сегментам, без дублей)
+std::vector<std::string> expand_prefix(const std::string& prefix) {
+    std::vector<std::string> terms;
+    {
+        StageTimer timer(qt.fetch);
+        for (const auto& seg : segments_) {
+            collect_prefix_in_segment(seg, prefix, terms);
+        }
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    }
+    if (terms.size() > MAX_EXPAND) {
+        // Оставляем самые частые — они и определяют результат
+        std::vector<std::pair<long long, std::string>> by_freq;
+        by_freq.reserve(terms.size());
+        for (auto& t : terms) {
+            by_freq.emplace_back(-find_term(t).freq, std::move(t));
+        }
+        std::sort(by_freq.begin(), by_freq.end());
+        terms.clear();
+        for (size_t i = 0; i < MAX_EXPAND; ++i) {
+            terms.push_back(std::move(by_freq[i].second));
+        }
+        std::sort(terms.begin(), terms.end());
+    }
+    return terms;
+}
+
+// Список документов — отсортированный массив doc_id
+using DocList = std::vector<int>;
+
+// Невладеющий взгляд на отсортированный список постингов
+// (распакованный лист запроса или промежуточный DocList)
+struct DocSpan {
+    const int* data = nullptr;
+    size_t size = 0;
+
+    DocSpan() {}
+    DocSpan(const int* d, size_t n) : data(d), size(n) {}
+    DocSpan(const DocList& v) : data(v.data()), size(v.size()) {}
+
+    int operator[](size_t i) const { return data[i]; }
+};
+
+// Пропуск позиций постинга (tf варинтов) в позиционных сегментах
+inline void skip_positions(const unsigned char*& p, const TermInfo& info, int tf) {
+    if (info.has_positions) {
+        for (int k = 0; k < tf; ++k) read_varint(p);
+    }
+}
+
+// Потоковая распаковка дельта+варинт списка одного сегмента в
+// возрастающие doc_id (варинты tf пропускаются); дельта сбрасывается
+// на границе блока
+void decode_part(const TermInfo& info, DocList& out) {
+    const unsigned char* p = info.postings;
+    int doc_id = 0;
+    for (int i = 0; i < info.doc_count; ++i) {
+        if (i % SKIP_BLOCK == 0) doc_id = 0;
+        doc_id += read_varint(p);
+        int tf = static_cast<int>(read_varint(p));
+        skip_positions(p, info, tf);
+        out.push_back(doc_id);
+    }
+}
+
+// Распаковка всех сегментов терма: диапазоны doc_id сегментов не
+// пересекаются и идут по возрастанию, так что конкатенация остаётся
+// отсортированной
+DocList decode_postings(const TermPostings& term) {
+    StageTimer timer(qt.fetch);
     DocList result;
-    if (a.size() > b.size()) {
-        for (int doc_id : b) {
-            if (a.find(doc_id) != a.end()) {
-                result.insert(doc_id);
+    result.reserve(term.doc_count);
+    for (const auto& part : term.parts) {
+        decode_part(part, result);
+    }
+    return result;
+}
+
+// Распаковка вместе с частотами термов для ранжирования
+void decode_postings_with_tf(const TermPostings& term,
+                             std::vector<int>& doc_ids,
+                             std::vector<int>& tfs) {
+    StageTimer timer(qt.fetch);
+    doc_ids.clear();
+    tfs.clear();
+    doc_ids.reserve(term.doc_count);
+    tfs.reserve(term.doc_count);
+    for (const auto& part : term.parts) {
+        const unsigned char* p = part.postings;
+        int doc_id = 0;
+        for (int i = 0; i < part.doc_count; ++i) {
+            if (i % SKIP_BLOCK == 0) doc_id = 0;
+            doc_id += read_varint(p);
+            int tf = static_cast<int>(read_varint(p));
+            skip_positions(p, part, tf);
+            doc_ids.push_back(doc_id);
+            tfs.push_back(tf);
+        }
+    }
+}
+
+// Распаковка с позициями токенов для фразовых запросов; в сегментах
+// без позиций (version 5) списки позиций остаются пустыми
+void decode_postings_with_positions(const TermPostings& term,
+                                    std::vector<int>& doc_ids,
+                                    std::vector<std::vector<int>>& positions) {
+    StageTimer timer(qt.fetch);
+    doc_ids.clear();
+    positions.clear();
+    doc_ids.reserve(term.doc_count);
+    positions.reserve(term.doc_count);
+    for (const auto& part : term.parts) {
+        const unsigned char* p = part.postings;
+        int doc_id = 0;
+        for (int i = 0; i < part.doc_count; ++i) {
+            if (i % SKIP_BLOCK == 0) doc_id = 0;
+            doc_id += read_varint(p);
+            int tf = static_cast<int>(read_varint(p));
+            doc_ids.push_back(doc_id);
+            positions.emplace_back();
+            if (part.has_positions) {
+                auto& plist = positions.back();
+                plist.reserve(tf);
+                int pos = 0;
+                for (int k = 0; k < tf; ++k) {
+                    pos += read_varint(p);
+                    plist.push_back(pos);
+                }
+            }
+        }
+    }
+}
+
+// Распаковка одного блока длинного списка
+void decode_block(const TermInfo& info, int block, std::vector<int>& out) {
+    out.clear();
+    const unsigned char* p = info.postings + info.skips[block].offset;
+    int count = std::min(SKIP_BLOCK, info.doc_count - block * SKIP_BLOCK);
+    int doc_id = 0;
+    for (int i = 0; i < count; ++i) {
+        doc_id += read_varint(p);
+        int tf = static_cast<int>(read_varint(p));
+        skip_positions(p, info, tf);
+        out.push_back(doc_id);
+    }
+}
+
+// Галопирующий (экспоненциальный) поиск: первая позиция >= target, начиная с lo
+size_t gallop(DocSpan v, size_t lo, int target) {
+    size_t step = 1;
+    size_t hi = lo;
+    while (hi < v.size && v[hi] < target) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > v.size) hi = v.size;
+    return std::lower_bound(v.data + lo, v.data + hi, target) - v.data;
+}
+
+DocList intersect(DocSpan a, DocSpan b) {
+    StageTimer timer(qt.setop);
+    DocSpan small = (a.size <= b.size) ? a : b;
+    DocSpan large = (a.size <= b.size) ? b : a;
+
+    DocList result;
+    result.reserve(small.size);
+
+    // При сильном перекосе размеров галопируем по длинному списку,
+    // иначе обычное линейное слияние
+    if (small.size > 0 && large.size / small.size >= 16) {
+        size_t pos = 0;
+        for (size_t i = 0; i < small.size; ++i) {
+            int doc_id = small[i];
+            pos = gallop(large, pos, doc_id);
+            if (pos == large.size) break;
+            if (large[pos] == doc_id) {
+                result.push_back(doc_id);
+                pos++;
             }
         }
     } else {
-        for (int doc_id : a) {
-            if (b.find(doc_id) != b.end()) {
-                result.insert(doc_id);
+        size_t i = 0, j = 0;
+        while (i < small.size && j < large.size) {
+            if (small[i] < large[j]) i++;
+            else if (large[j] < small[i]) j++;
+            else {
+                result.push_back(small[i]);
+                i++;
+                j++;
+            }
+        }
+    }
+    return result;
+}
+
+// Пересечение короткого списка с длинным сжатым списком через скипы:
+// декодируются только те блоки длинного списка, где возможны совпадения.
+// Сегменты терма обходятся по очереди — их диапазоны doc_id не
+// пересекаются и возрастают
+DocList intersect_with_skips(DocSpan small, const TermPostings& large) {
+    StageTimer timer(qt.setop);
+    DocList result;
+    result.reserve(small.size);
+
+    std::vector<int> block;
+    size_t i = 0;
+
+    for (const auto& part : large.parts) {
+        if (i >= small.size) break;
+
+        if (part.skip_count == 0) {
+            // Короткий сегмент — декодируем целиком
+            block.clear();
+            decode_part(part, block);
+            size_t pos = 0;
+            while (i < small.size) {
+                pos = gallop(DocSpan(block), pos, small[i]);
+                if (pos == block.size()) break; // дальше этого сегмента
+                if (block[pos] == small[i]) {
+                    result.push_back(small[i]);
+                    pos++;
+                }
+                i++;
+            }
+            continue;
+        }
+
+        int cur_block = -1;
+        int skip_idx = 0;
+        size_t pos = 0;
+
+        while (i < small.size) {
+            int doc_id = small[i];
+
+            while (skip_idx < part.skip_count &&
+                   part.skips[skip_idx].last_doc < doc_id) {
+                skip_idx++;
             }
+            if (skip_idx == part.skip_count) break; // дальше этого сегмента
+
+            if (skip_idx != cur_block) {
+                decode_block(part, skip_idx, block);
+                cur_block = skip_idx;
+                pos = 0;
+            }
+
+            pos = gallop(DocSpan(block), pos, doc_id);
+            if (pos < block.size() && block[pos] == doc_id) {
+                result.push_back(doc_id);
+                pos++;
+            }
+            i++;
+        }
+    }
+    return result;
+}
+
+DocList union_op(DocSpan a, DocSpan b) {
+    StageTimer timer(qt.setop);
+    DocList result;
+    result.reserve(a.size + b.size);
+    size_t i = 0, j = 0;
+    while (i < a.size && j < b.size) {
+        if (a[i] < b[j]) result.push_back(a[i++]);
+        else if (b[j] < a[i]) result.push_back(b[j++]);
+        else {
+            result.push_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+    while (i < a.size) result.push_back(a[i++]);
+    while (j < b.size) result.push_back(b[j++]);
+    return result;
+}
+
+// Разность отсортированных списков a \ b; при сильном перекосе
+// вычитаемого галопируем по нему вместо линейного слияния
+DocList difference(DocSpan a, DocSpan b) {
+    StageTimer timer(qt.setop);
+    DocList result;
+    result.reserve(a.size);
+
+    if (a.size > 0 && b.size / a.size >= 16) {
+        size_t pos = 0;
+        for (size_t i = 0; i < a.size; ++i) {
+            pos = gallop(b, pos, a[i]);
+            if (pos == b.size || b[pos] != a[i]) result.push_back(a[i]);
+        }
+    } else {
+        size_t i = 0, j = 0;
+        while (i < a.size) {
+            if (j == b.size || a[i] < b[j]) result.push_back(a[i++]);
+            else if (b[j] < a[i]) j++;
+            else { i++; j++; }
+        }
+    }
+    return result;
+}
+
+// Кэш распакованных постингов горячих термов с явным бюджетом
+// (ENGINE_POSTING_CACHE_MB): индекс отображён в память и может не
+// помещаться в RAM, а распределение обращений к термам сильно
+// скошено, поэтому малая доля словаря закрывает почти все выборки.
+// Вытеснение — LFU: записи живут в частотных корзинах, вытесняется
+// голова самой холодной; новая запись не принимается, если даже
+// самая холодная в кэше горячее неё, — одноразовые термы не
+// вымывают устоявшийся рабочий набор
+struct PostingEntry {
+    DocList docs;
+    long long uses = 0;
+    size_t bytes = 0;
+    std::list<std::string>::iterator pos; // позиция в своей корзине
+};
+
+std::unordered_map<std::string, PostingEntry> posting_map;
+std::map<long long, std::list<std::string>> posting_freq; // uses -> термы
+size_t posting_cache_bytes = 0;
+size_t posting_cache_budget = 256 << 20;
+std::mutex posting_cache_mutex;
+
+// Перенос записи в корзину uses+1 при обращении
+void posting_bump(std::unordered_map<std::string, PostingEntry>::iterator it) {
+    PostingEntry& e = it->second;
+    auto& old_bucket = posting_freq[e.uses];
+    std::string term = std::move(*e.pos);
+    old_bucket.erase(e.pos);
+    if (old_bucket.empty()) posting_freq.erase(e.uses);
+    e.uses++;
+    auto& bucket = posting_freq[e.uses];
+    bucket.push_front(std::move(term));
+    e.pos = bucket.begin();
+}
+
+bool posting_cache_get(const std::string& term, DocList& out) {
+    std::unique_lock<std::mutex> lock(posting_cache_mutex);
+    auto it = posting_map.find(term);
+    if (it == posting_map.end()) {
+        posting_cache_misses++;
+        return false;
+    }
+    posting_bump(it);
+    posting_cache_hits++;
+    out = it->second.docs; // копия: запись могут вытеснить после unlock
+    return true;
+}
+
+void posting_cache_put(const std::string& term, const DocList& docs) {
+    size_t bytes = docs.size() * sizeof(int) + term.size()
+                 + sizeof(PostingEntry);
+    if (bytes > posting_cache_budget) return;
+
+    std::unique_lock<std::mutex> lock(posting_cache_mutex);
+    if (posting_map.count(term)) return; // параллельный запрос успел раньше
+
+    while (posting_cache_bytes + bytes > posting_cache_budget &&
+           !posting_map.empty()) {
+        auto coldest = posting_freq.begin();
+        if (coldest->first > 1) return; // все жители горячее новичка
+        const std::string& victim = coldest->second.back();
+        posting_cache_bytes -= posting_map[victim].bytes;
+        posting_map.erase(victim);
+        coldest->second.pop_back();
+        if (coldest->second.empty()) posting_freq.erase(coldest);
+    }
+
+    PostingEntry e;
+    e.docs = docs;
+    e.uses = 1;
+    e.bytes = bytes;
+    auto& bucket = posting_freq[1];
+    bucket.push_front(term);
+    e.pos = bucket.begin();
+    posting_map[term] = std::move(e);
+    posting_cache_bytes += bytes;
+}
+
+// Плотное представление множества документов: по биту на doc_id.
+// Когда множество покрывает заметную долю коллекции, упакованный
+// битсет меньше массива int, а AND/OR/NOT над ним — пословные
+// 64-битные операции вместо слияний списков
+struct BitSet {
+    std::vector<unsigned long long> words;
+    size_t count = 0; // число установленных битов
+
+    void set(int doc_id) {
+        words[doc_id >> 6] |= 1ULL << (doc_id & 63);
+    }
+    bool test(int doc_id) const {
+        return (words[doc_id >> 6] >> (doc_id & 63)) & 1;
+    }
+};
+
+// Множество плотное, если битсет компактнее списка int:
+// documents.size()/8 байт против 4 байт на элемент
+const size_t DENSE_RATIO = 32;
+
+bool is_dense(size_t size) {
+    return size * DENSE_RATIO >= documents.size();
+}
+
+BitSet list_to_bits(DocSpan a) {
+    StageTimer timer(qt.setop);
+    BitSet b;
+    b.words.assign((documents.size() + 63) / 64, 0);
+    for (size_t i = 0; i < a.size; ++i) b.set(a[i]);
+    b.count = a.size;
+    return b;
+}
+
+DocList bits_to_list(const BitSet& b) {
+    StageTimer timer(qt.setop);
+    DocList result;
+    result.reserve(b.count);
+    for (size_t w = 0; w < b.words.size(); ++w) {
+        unsigned long long word = b.words[w];
+        while (word) {
+            result.push_back((int)(w * 64 + __builtin_ctzll(word)));
+            word &= word - 1;
         }
     }
     return result;
 }
 
-DocList union_op(const DocList& a, const DocList& b) {
-    DocList result = a;
-    result.insert(b.begin(), b.end());
+BitSet bits_and(const BitSet& a, const BitSet& b) {
+    StageTimer timer(qt.setop);
+    BitSet r;
+    r.words.resize(a.words.size());
+    for (size_t i = 0; i < a.words.size(); ++i) {
+        r.words[i] = a.words[i] & b.words[i];
+        r.count += __builtin_popcountll(r.words[i]);
+    }
+    return r;
+}
+
+BitSet bits_or(const BitSet& a, const BitSet& b) {
+    StageTimer timer(qt.setop);
+    BitSet r;
+    r.words.resize(a.words.size());
+    for (size_t i = 0; i < a.words.size(); ++i) {
+        r.words[i] = a.words[i] | b.words[i];
+        r.count += __builtin_popcountll(r.words[i]);
+    }
+    return r;
+}
+
+// NOT: инверсия слов с обнулением хвостовых битов за последним doc_id
+BitSet bits_not(const BitSet& a) {
+    StageTimer timer(qt.setop);
+    BitSet r;
+    r.words.resize(a.words.size());
+    for (size_t i = 0; i < a.words.size(); ++i) {
+        r.words[i] = ~a.words[i];
+    }
+    size_t tail = documents.size() & 63;
+    if (tail && !r.words.empty()) {
+        r.words.back() &= (1ULL << tail) - 1;
+    }
+    r.count = documents.size() - a.count;
+    return r;
+}
+
+// Фильтрация короткого списка по битсету: результат остаётся разреженным
+DocList list_and_bits(DocSpan a, const BitSet& b) {
+    StageTimer timer(qt.setop);
+    DocList result;
+    result.reserve(a.size);
+    for (size_t i = 0; i < a.size; ++i) {
+        if (b.test(a[i])) result.push_back(a[i]);
+    }
     return result;
 }
 
-DocList complement(const DocList& a) {
+// Фразовый запрос: документы, где термы фразы стоят подряд.
+// Списки термов распаковываются с позициями, пересечение идёт по
+// doc_id, и для каждого общего документа проверяется, что за позицией
+// первого терма следуют позиции остальных со сдвигами 1, 2, ...
+// Требует позиционного индекса (indexer с -DWITH_POSITIONS)
+DocList phrase_match(const std::string& phrase) {
+    std::vector<std::string> terms;
+    std::istringstream iss(phrase);
+    std::string term;
+    while (iss >> term) terms.push_back(term);
+
     DocList result;
-    for (int i = 0; i < documents.size(); ++i) {
-        if (a.find(i) == a.end()) {
-            result.insert(i);
+    if (terms.empty()) return result;
+
+    std::vector<std::vector<int>> doc_lists(terms.size());
+    std::vector<std::vector<std::vector<int>>> pos_lists(terms.size());
+    for (size_t t = 0; t < terms.size(); ++t) {
+        TermPostings info = find_term(terms[t]);
+        if (!info.found) return result;
+        for (const auto& part : info.parts) {
+            if (!part.has_positions) {
+                std::cerr << "Phrase queries need a positional index "
+                             "(build indexer with -DWITH_POSITIONS)\n";
+                return result;
+            }
+        }
+        decode_postings_with_positions(info, doc_lists[t], pos_lists[t]);
+    }
+
+    // Идём по самому редкому терму — первому, у которого короче список
+    std::vector<size_t> cursor(terms.size(), 0);
+    for (size_t i = 0; i < doc_lists[0].size(); ++i) {
+        int doc_id = doc_lists[0][i];
+
+        bool in_all = true;
+        for (size_t t = 1; t < terms.size(); ++t) {
+            cursor[t] = gallop(DocSpan(doc_lists[t]), cursor[t], doc_id);
+            if (cursor[t] == doc_lists[t].size()) return result;
+            if (doc_lists[t][cursor[t]] != doc_id) { in_all = false; break; }
+        }
+        if (!in_all) continue;
+
+        // Проверка смежности позиций внутри документа
+        for (int p0 : pos_lists[0][i]) {
+            bool match = true;
+            for (size_t t = 1; t < terms.size(); ++t) {
+                const auto& plist = pos_lists[t][cursor[t]];
+                if (!std::binary_search(plist.begin(), plist.end(),
+                                        p0 + (int)t)) {
+                    match = false;
+                    break;
+                }
+            }
+            if (match) {
+                result.push_back(doc_id);
+                break;
+            }
         }
     }
     return result;
@@ -157,6 +1129,7 @@ DocList complement(const DocList& a) {
 
 enum TokenType {
     TOKEN_TERM,
+    TOKEN_PHRASE,
     TOKEN_AND,
     TOKEN_OR,
     TOKEN_NOT,
@@ -190,7 +1163,7 @@ private:
         while (pos_ < query_.size()) {
             char c = query_[pos_];
             if (std::isspace(c) || c == '(' || c == ')' ||
-                c == '!' || c == '&' || c == '|') {
+                c == '!' || c == '&' || c == '|' || c == '"') {
                 break;
             }
             ++pos_;
@@ -211,6 +1184,15 @@ public:
         char c = query_[pos_];
 
         switch (c) {
+            case '"': {
+                // Фразовый запрос: всё до закрывающей кавычки
+                ++pos_;
+                size_t start = pos_;
+                while (pos_ < query_.size() && query_[pos_] != '"') ++pos_;
+                std::string phrase = query_.substr(start, pos_ - start);
+                if (pos_ < query_.size()) ++pos_; // закрывающая кавычка
+                return Token(TOKEN_PHRASE, phrase);
+            }
             case '(':
                 ++pos_;
                 return Token(TOKEN_LPAREN);
@@ -244,63 +1226,329 @@ public:
     }
 };
 
+// Узел вычисления запроса: лист-терм остаётся в сжатом виде до
+// первого использования, чтобы AND мог пройти по скипам без полного
+// декодирования длинного списка; плотные подвыражения (NOT, плотные
+// AND/OR) живут как битсеты и обрабатываются пословными операциями
+struct EvalNode {
+    DocSpan span;
+    bool is_term = false;
+    std::string term; // имя терма-листа — ключ кэша постингов
+    TermPostings info;
+    bool is_bits = false;
+    BitSet bits;
+};
+
+// Узел дерева запроса для стадии планирования: сначала выражение
+// разбирается целиком, затем оптимизатор переставляет коммутативные
+// операнды и переписывает NOT, и только потом дерево вычисляется.
+// Благодаря этому `common && rare` и `rare && common` стоят одинаково
+struct PlanNode {
+    enum Kind { TERM, PHRASE, AND, OR, NOT } kind = TERM;
+    std::string value;           // TERM/PHRASE
+    std::vector<PlanNode> kids;  // AND/OR — плоский список, NOT — один
+    TermPostings info;           // найденные постинги терма
+    size_t est = 0;              // оценка мощности результата
+};
+
 class QueryEvaluator {
 private:
     QueryParser& parser_;
     Token current_token_;
 
+    // Промежуточные результаты живут здесь до конца вычисления
+    std::vector<DocList> owned_;
+
+    DocSpan own(DocList&& v) {
+        owned_.push_back(std::move(v));
+        return DocSpan(owned_.back());
+    }
+
     void advance() {
         current_token_ = parser_.get_next_token();
     }
 
-    DocList parse_expression() {
-        DocList result = parse_term();
+    static size_t node_size(const EvalNode& n) {
+        if (n.is_term) return (size_t)n.info.doc_count;
+        if (n.is_bits) return n.bits.count;
+        return n.span.size;
+    }
+
+    DocSpan materialize(EvalNode& n) {
+        if (n.is_term) {
+            // Горячие термы берутся из кэша распакованных постингов
+            DocList docs;
+            if (n.term.empty() || !posting_cache_get(n.term, docs)) {
+                docs = decode_postings(n.info);
+                if (!n.term.empty()) posting_cache_put(n.term, docs);
+            }
+            n.span = own(std::move(docs));
+            n.is_term = false;
+        } else if (n.is_bits) {
+            n.span = own(bits_to_list(n.bits));
+            n.is_bits = false;
+        }
+        return n.span;
+    }
+
+    BitSet to_bits(EvalNode& n) {
+        if (n.is_bits) return std::move(n.bits);
+        return list_to_bits(materialize(n));
+    }
+
+    EvalNode apply_and(EvalNode& a, EvalNode& b) {
+        EvalNode& small = (node_size(a) <= node_size(b)) ? a : b;
+        EvalNode& large = (node_size(a) <= node_size(b)) ? b : a;
+
+        EvalNode result;
+        if (a.is_bits && b.is_bits) {
+            // Оба операнда плотные — пословный AND
+            result.bits = bits_and(a.bits, b.bits);
+            result.is_bits = true;
+        } else if (a.is_bits || b.is_bits) {
+            // Короткая сторона фильтруется по битсету за O(1) на документ
+            EvalNode& dense = a.is_bits ? a : b;
+            EvalNode& sparse = a.is_bits ? b : a;
+            result.span = own(list_and_bits(materialize(sparse), dense.bits));
+        } else if (large.is_term && node_size(small) > 0 &&
+                   node_size(large) / node_size(small) >= 16) {
+            // Длинный сжатый терм со скипами против короткой стороны:
+            // декодируем только нужные блоки длинного списка
+            result.span = own(intersect_with_skips(materialize(small), large.info));
+        } else {
+            result.span = own(intersect(materialize(small), materialize(large)));
+        }
+        return result;
+    }
+
+    EvalNode apply_or(EvalNode& a, EvalNode& b) {
+        EvalNode result;
+        if (a.is_bits || b.is_bits ||
+            (is_dense(node_size(a)) && is_dense(node_size(b)))) {
+            // Плотное объединение выгоднее держать битсетом
+            BitSet ab = to_bits(a);
+            BitSet bb = to_bits(b);
+            result.bits = bits_or(ab, bb);
+            result.is_bits = true;
+        } else {
+            result.span = own(union_op(materialize(a), materialize(b)));
+        }
+        return result;
+    }
+
+    // --- Разбор: строим дерево, ничего не вычисляя ---
+
+    PlanNode parse_expression() {
+        PlanNode result = parse_term();
 
         while (current_token_.type == TOKEN_AND || current_token_.type == TOKEN_OR) {
-            TokenType op = current_token_.type;
+            PlanNode::Kind op = (current_token_.type == TOKEN_AND)
+                                    ? PlanNode::AND : PlanNode::OR;
             advance();
-            DocList right = parse_term();
+            PlanNode right = parse_term();
 
-            if (op == TOKEN_AND) {
-                result = intersect(result, right);
-            } else { // TOKEN_OR
-                result = union_op(result, right);
+            // Цепочка одинаковых операторов складывается в плоский
+            // n-арный узел — так оптимизатору есть что переставлять
+            if (result.kind == op) {
+                result.kids.push_back(std::move(right));
+            } else {
+                PlanNode node;
+                node.kind = op;
+                node.kids.push_back(std::move(result));
+                node.kids.push_back(std::move(right));
+                result = std::move(node);
             }
         }
 
         return result;
     }
 
-    DocList parse_term() {
+    PlanNode parse_term() {
         if (current_token_.type == TOKEN_NOT) {
             advance();
-            DocList result = parse_factor();
-            return complement(result);
+            PlanNode node;
+            node.kind = PlanNode::NOT;
+            node.kids.push_back(parse_factor());
+            return node;
         }
 
         return parse_factor();
     }
 
-    DocList parse_factor() {
+    PlanNode parse_factor() {
         if (current_token_.type == TOKEN_LPAREN) {
             advance();
-            DocList result = parse_expression();
+            PlanNode result = parse_expression();
             if (current_token_.type != TOKEN_RPAREN) {
                 std::cerr << "Error: Expected ')'\n";
-                return DocList();
+                return PlanNode();
             }
             advance();
             return result;
         }
 
         if (current_token_.type == TOKEN_TERM) {
-            std::string term = current_token_.value;
+            PlanNode node;
+            node.kind = PlanNode::TERM;
+            node.value = current_token_.value;
+            advance();
+
+            // Подстановка: 'футбол*' раскрывается по словарю в OR
+            // непрерывного диапазона термов с этим префиксом
+            if (!node.value.empty() && node.value.back() == '*') {
+                std::string prefix = node.value.substr(0, node.value.size() - 1);
+                node.kind = PlanNode::OR;
+                for (const auto& term : expand_prefix(prefix)) {
+                    PlanNode kid;
+                    kid.kind = PlanNode::TERM;
+                    kid.value = term;
+                    kid.info = find_term(term);
+                    node.kids.push_back(std::move(kid));
+                }
+                if (node.kids.empty()) {
+                    node.kind = PlanNode::TERM; // нет таких термов
+                } else if (node.kids.size() == 1) {
+                    PlanNode only = std::move(node.kids[0]);
+                    return only;
+                }
+                return node;
+            }
+
+            node.info = find_term(node.value);
+            return node;
+        }
+
+        if (current_token_.type == TOKEN_PHRASE) {
+            PlanNode node;
+            node.kind = PlanNode::PHRASE;
+            node.value = current_token_.value;
             advance();
-            return get_docs_for_term(term);
+            return node;
         }
 
         std::cerr << "Error: Unexpected token\n";
-        return DocList();
+        return PlanNode();
+    }
+
+    // --- Планирование: оценки мощности и перестановка операндов ---
+
+    void plan(PlanNode& n) {
+        for (auto& kid : n.kids) plan(kid);
+
+        switch (n.kind) {
+            case PlanNode::TERM:
+                n.est = (size_t)n.info.doc_count;
+                break;
+            case PlanNode::PHRASE: {
+                // Фраза не шире своего самого редкого слова
+                n.est = documents.size();
+                std::istringstream iss(n.value);
+                std::string word;
+                while (iss >> word) {
+                    TermPostings tp = find_term(word);
+                    n.est = std::min(n.est, (size_t)tp.doc_count);
+                }
+                break;
+            }
+            case PlanNode::NOT:
+                n.est = documents.size() - std::min(documents.size(),
+                                                    n.kids[0].est);
+                break;
+            case PlanNode::AND: {
+                // Дешёвые операнды вперёд: пересечение сужается сразу,
+                // а NOT-операнды уходят в хвост и становятся разностью
+                std::stable_sort(n.kids.begin(), n.kids.end(),
+                    [](const PlanNode& a, const PlanNode& b) {
+                        bool an = a.kind == PlanNode::NOT;
+                        bool bn = b.kind == PlanNode::NOT;
+                        if (an != bn) return bn;
+                        return a.est < b.est;
+                    });
+                n.est = n.kids.front().est;
+                for (const auto& kid : n.kids) n.est = std::min(n.est, kid.est);
+                break;
+            }
+            case PlanNode::OR: {
+                std::stable_sort(n.kids.begin(), n.kids.end(),
+                    [](const PlanNode& a, const PlanNode& b) {
+                        return a.est < b.est;
+                    });
+                n.est = 0;
+                for (const auto& kid : n.kids) {
+                    n.est = std::min(documents.size(), n.est + kid.est);
+                }
+                break;
+            }
+        }
+    }
+
+    // --- Вычисление спланированного дерева ---
+
+    EvalNode eval(PlanNode& n) {
+        switch (n.kind) {
+            case PlanNode::TERM: {
+                EvalNode node;
+                node.info = std::move(n.info);
+                node.is_term = node.info.found;
+                if (node.is_term) node.term = n.value;
+                return node;
+            }
+            case PlanNode::PHRASE: {
+                EvalNode node;
+                node.span = own(phrase_match(n.value));
+                return node;
+            }
+            case PlanNode::NOT: {
+                // Дополнение почти всегда плотное — инвертируем битсет,
+                // а не строим список почти на всю коллекцию
+                EvalNode inner = eval(n.kids[0]);
+                EvalNode c;
+                c.bits = bits_not(to_bits(inner));
+                c.is_bits = true;
+                return c;
+            }
+            case PlanNode::AND: {
+                // NOT-операнды отсортированы в хвост: сначала сужаем
+                // положительную часть, потом вычитаем отрицания
+                size_t i = 0;
+                EvalNode acc;
+                if (n.kids[0].kind != PlanNode::NOT) {
+                    acc = eval(n.kids[i++]);
+                    while (i < n.kids.size() &&
+                           n.kids[i].kind != PlanNode::NOT) {
+                        EvalNode right = eval(n.kids[i++]);
+                        acc = apply_and(acc, right);
+                    }
+                } else {
+                    acc = eval(n.kids[i++]); // одни отрицания — битсет
+                }
+                for (; i < n.kids.size(); ++i) {
+                    // A && !B — разность множеств, дополнение не нужно
+                    EvalNode inner = eval(n.kids[i].kids[0]);
+                    if (acc.is_bits || inner.is_bits) {
+                        EvalNode neg;
+                        neg.bits = bits_not(to_bits(inner));
+                        neg.is_bits = true;
+                        acc = apply_and(acc, neg);
+                    } else {
+                        EvalNode result;
+                        result.span = own(difference(materialize(acc),
+                                                     materialize(inner)));
+                        acc = std::move(result);
+                    }
+                }
+                return acc;
+            }
+            case PlanNode::OR: {
+                EvalNode acc = eval(n.kids[0]);
+                for (size_t i = 1; i < n.kids.size(); ++i) {
+                    EvalNode right = eval(n.kids[i]);
+                    acc = apply_or(acc, right);
+                }
+                return acc;
+            }
+        }
+        return EvalNode();
     }
 
 public:
@@ -309,63 +1557,991 @@ public:
     }
 
     DocList evaluate() {
-        return parse_expression();
+        PlanNode tree = parse_expression();
+        plan(tree);
+        EvalNode result = eval(tree);
+        DocSpan span = materialize(result);
+        return DocList(span.data, span.data + span.size);
     }
 };
 
-void search_single_term(const std::string& term) {
-    auto it = hash_table.find(term);
-    if (it == hash_table.end()) {
-        std::cout << "Term not found\n";
-        return;
+// Кэш результатов запросов: распределение запросов сильно скошено,
+// поэтому горячие строки выгодно превращать в поиск по хешу. Ключ —
+// нормализованный запрос (каноничные пробелы), значение — готовый
+// отсортированный список doc_id (плюс freq для одиночного терма).
+// Вытеснение LRU в пределах бюджета памяти (ENGINE_CACHE_MB, по
+// умолчанию 64); кэшируются булевы и однотермовые запросы — индекс
+// после загрузки неизменяем, так что инвалидация не нужна
+struct CacheEntry {
+    std::string key;
+    DocList docs;
+    long long freq;  // freq одиночного терма; -1 для булевых запросов
+    size_t bytes;
+};
+
+std::list<CacheEntry> cache_lru; // голова — самый свежий
+std::unordered_map<std::string, std::list<CacheEntry>::iterator> cache_map;
+size_t cache_bytes = 0;
+size_t cache_budget = 64 << 20;
+std::mutex cache_mutex;
+
+// Каноничная форма запроса: пробельные серии схлопываются в один
+// пробел, края обрезаются (термы в индексе уже стеммированы при
+// построении, на стороне запроса стемминга нет)
+std::string normalize_query(const std::string& query) {
+    std::string norm;
+    norm.reserve(query.size());
+    for (char c : query) {
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            if (!norm.empty() && norm.back() != ' ') norm.push_back(' ');
+        } else {
+            norm.push_back(c);
+        }
+    }
+    if (!norm.empty() && norm.back() == ' ') norm.pop_back();
+    return norm;
+}
+
+bool cache_get(const std::string& key, DocList& docs, long long& freq) {
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    auto it = cache_map.find(key);
+    if (it == cache_map.end()) return false;
+    cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+    docs = it->second->docs;
+    freq = it->second->freq;
+    return true;
+}
+
+void cache_put(const std::string& key, const DocList& docs, long long freq) {
+    // Примерная стоимость записи: ключ + список + накладные расходы узла
+    size_t bytes = key.size() + docs.size() * sizeof(int) + 96;
+    if (bytes > cache_budget) return;
+
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    if (cache_map.count(key)) return; // параллельный запрос успел раньше
+
+    while (cache_bytes + bytes > cache_budget && !cache_lru.empty()) {
+        cache_bytes -= cache_lru.back().bytes;
+        cache_map.erase(cache_lru.back().key);
+        cache_lru.pop_back();
     }
 
-    TermEntry* e = it->second;
-    std::cout << "Term: " << e->term << ", freq=" << e->freq
-              << ", doc_count=" << e->doc_count << "\nDocuments:\n";
+    cache_lru.push_front({key, docs, freq, bytes});
+    cache_map[key] = cache_lru.begin();
+    cache_bytes += bytes;
+}
+
+// Распаковка блока хранилища (формат compress_block в indexer/main.cpp)
+void decompress_block(const unsigned char* src, int comp_bytes,
+                      unsigned char* dst, int raw_bytes) {
+    const unsigned char* p = src;
+    const unsigned char* end = src + comp_bytes;
+    int di = 0;
+
+    while (p < end) {
+        int token = *p++;
+        int lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do { b = *p++; lit += b; } while (b == 255);
+        }
+        if (di + lit > raw_bytes) break; // повреждённый блок
+        std::memcpy(dst + di, p, lit);
+        di += lit;
+        p += lit;
+        if (p >= end) break; // хвост блока — только литералы
+
+        int off = p[0] | (p[1] << 8);
+        p += 2;
+        int match = token & 15;
+        if (match == 15) {
+            int b;
+            do { b = *p++; match += b; } while (b == 255);
+        }
+        match += 4;
+        if (off <= 0 || off > di || di + match > raw_bytes) break;
+        // Повтор может перекрываться сам с собой — копируем побайтово
+        for (int j = 0; j < match; ++j, ++di) dst[di] = dst[di - off];
+    }
+}
+
+// Простые термы запроса для центрирования сниппета (операторы и
+// кавычки отбрасываются)
+std::vector<std::string> snippet_terms(const std::string& query) {
+    std::vector<std::string> terms;
+    std::string cur;
+    for (char c : query) {
+        if (c == ' ' || c == '&' || c == '|' || c == '!' ||
+            c == '(' || c == ')' || c == '"' || c == '*') {
+            if (!cur.empty()) terms.push_back(std::move(cur));
+            cur.clear();
+        } else {
+            cur += c;
+        }
+    }
+    if (!cur.empty()) terms.push_back(std::move(cur));
+    return terms;
+}
+
+// Сниппет документа: распаковывается блок с текстом (последний блок
+// кэшируется на поток — соседние результаты часто делят блок), в
+// тексте ищется первое слово, начинающееся с терма запроса (стеммер
+// только усекает слова, поэтому терм из индекса — префикс исходной
+// словоформы), и вокруг него вырезается окно по границам слов
+std::string make_snippet(int doc_id, const std::vector<std::string>& terms) {
+    if (!docstore.base || doc_id < 0 || doc_id >= docstore.doc_count) return "";
+    const DocStore::DocEntry& d = docstore.docs[doc_id];
+    if (d.length == 0) return "";
+
+    thread_local int cached_block = -1;
+    thread_local std::vector<char> block_buf;
+    if (cached_block != d.block) {
+        const DocStore::BlockEntry& b = docstore.blocks[d.block];
+        block_buf.resize(b.raw_bytes);
+        decompress_block(
+            reinterpret_cast<const unsigned char*>(docstore.base + b.offset),
+            b.comp_bytes,
+            reinterpret_cast<unsigned char*>(block_buf.data()), b.raw_bytes);
+        cached_block = d.block;
+    }
+
+    const char* text = block_buf.data() + d.offset;
+    int len = d.length;
+
+    // Первое вхождение любого терма в начале слова
+    int match = -1;
+    for (int i = 0; i < len && match < 0; ) {
+        int end = i;
+        while (end < len && text[end] != ' ') end++;
+        for (const auto& t : terms) {
+            if (end - i >= (int)t.size() &&
+                std::memcmp(text + i, t.data(), t.size()) == 0) {
+                match = i;
+                break;
+            }
+        }
+        i = end + 1;
+    }
+    if (match < 0) match = 0;
+
+    // Окно вокруг вхождения, обрезанное по пробелам
+    const int BEFORE = 60, AFTER = 100;
+    int start = std::max(0, match - BEFORE);
+    while (start > 0 && text[start - 1] != ' ') start--; // к началу слова
+    int stop = std::min(len, match + AFTER);
+    while (stop > start && stop < len && text[stop] != ' ') stop--;
+
+    std::string snippet;
+    if (start > 0) snippet += "...";
+    snippet.append(text + start, stop - start);
+    while (!snippet.empty() && snippet.back() == ' ') snippet.pop_back();
+    if (stop < len) snippet += "...";
+    return snippet;
+}
+
+// Печать сниппета под строкой результата (если хранилище загружено)
+void print_snippet(std::ostream& out, int doc_id,
+                   const std::vector<std::string>& terms) {
+    if (!docstore.base) return;
+    std::string snippet = make_snippet(doc_id, terms);
+    if (!snippet.empty()) out << "  " << snippet << "\n";
+}
 
-    DocNode* n = e->docs;
+void search_single_term(const std::string& term, std::ostream& out) {
+    std::string key = normalize_query(term);
+    DocList docs;
+    long long freq;
+
+    if (!cache_get(key, docs, freq)) {
+        TermPostings info = find_term(term);
+        if (!info.found) {
+            out << "Term not found\n";
+            return;
+        }
+        if (!posting_cache_get(term, docs)) {
+            docs = decode_postings(info);
+            posting_cache_put(term, docs);
+        }
+        freq = info.freq;
+        cache_put(key, docs, freq);
+    }
+
+    StageTimer timer(qt.format);
+    out << "Term: " << term << ", freq=" << freq
+        << ", doc_count=" << docs.size() << "\nDocuments:\n";
+
+    std::vector<std::string> terms{term};
     int count = 0;
-    while (n && count < 50) {
-        if (n->doc_id >= 0 && n->doc_id < documents.size()) {
-            std::cout << "- " << documents[n->doc_id] << "\n";
+    for (int doc_id : docs) {
+        if (count >= 50) break;
+        if (doc_id >= 0 && doc_id < (int)documents.size()) {
+            out << "- " << documents[doc_id] << "\n";
+            print_snippet(out, doc_id, terms);
             count++;
         }
-        n = n->next;
     }
 
-    if (e->doc_count > 50) {
-        std::cout << "... and " << (e->doc_count - 50) << " more documents\n";
+    if ((int)docs.size() > 50) {
+        out << "... and " << (docs.size() - 50) << " more documents\n";
     }
 }
 
-void search_boolean(const std::string& query) {
-    QueryParser parser(query);
-    QueryEvaluator evaluator(parser);
-    DocList result = evaluator.evaluate();
+void search_boolean(const std::string& query, std::ostream& out) {
+    std::string key = normalize_query(query);
+    DocList result;
+    long long freq;
 
-    std::cout << "Found " << result.size() << " documents:\n";
+    if (!cache_get(key, result, freq)) {
+        QueryParser parser(query);
+        QueryEvaluator evaluator(parser);
+        result = evaluator.evaluate();
+        cache_put(key, result, -1);
+    }
 
-    std::vector<int> sorted_docs(result.begin(), result.end());
-    std::sort(sorted_docs.begin(), sorted_docs.end());
+    StageTimer timer(qt.format);
+    out << "Found " << result.size() << " documents:\n";
 
+    // Результат уже отсортирован по doc_id
+    std::vector<std::string> terms = snippet_terms(query);
     int count = 0;
-    for (int doc_id : sorted_docs) {
+    for (int doc_id : result) {
         if (count >= 50) {
-            std::cout << "... and " << (result.size() - 50) << " more documents\n";
+            out << "... and " << (result.size() - 50) << " more documents\n";
             break;
         }
-        if (doc_id >= 0 && doc_id < documents.size()) {
-            std::cout << "- " << documents[doc_id] << "\n";
+        if (doc_id >= 0 && doc_id < (int)documents.size()) {
+            out << "- " << documents[doc_id] << "\n";
+            print_snippet(out, doc_id, terms);
             count++;
         }
     }
 }
 
+// Курсор по спискам одного терма для WAND: постинги читаются лениво
+// прямо из отображённого файла, блоки с last_doc ниже цели
+// перескакиваются по скипам без распаковки. Части идут по
+// возрастающим непересекающимся диапазонам doc_id
+struct TermCursor {
+    TermPostings tp;
+    double idf = 0;
+    double max_score = 0; // idf * max_tf — верхняя граница вклада
+
+    size_t part = 0;
+    const unsigned char* p = nullptr;
+    int i = 0;    // номер следующего постинга текущей части
+    int prev = 0; // база дельты текущего блока
+    int doc = -1;
+    int tf = 0;
+    bool done = false;
+
+    // Следующий постинг; после исчерпания done и doc = INT_MAX
+    bool advance() {
+        while (part < tp.parts.size()) {
+            const TermInfo& pi = tp.parts[part];
+            if (p == nullptr) { p = pi.postings; i = 0; }
+            if (i >= pi.doc_count) { part++; p = nullptr; continue; }
+            if (i % SKIP_BLOCK == 0) prev = 0;
+            prev += read_varint(p);
+            doc = prev;
+            tf = static_cast<int>(read_varint(p));
+            skip_positions(p, pi, tf);
+            i++;
+            return true;
+        }
+        done = true;
+        doc = INT_MAX;
+        return false;
+    }
+
+    // Первый постинг с doc >= target
+    bool seek(int target) {
+        while (!done && doc < target) {
+            const TermInfo& pi = tp.parts[part];
+            if (p != nullptr && i > 0 && pi.skip_count > 0 && i < pi.doc_count) {
+                int b = (i - 1) / SKIP_BLOCK;
+                if (pi.skips[b].last_doc < target) {
+                    int nb = b + 1;
+                    while (nb < pi.skip_count && pi.skips[nb].last_doc < target) nb++;
+                    if (nb >= pi.skip_count) {
+                        // вся часть ниже цели
+                        part++;
+                        p = nullptr;
+                        if (part >= tp.parts.size()) {
+                            done = true;
+                            doc = INT_MAX;
+                            return false;
+                        }
+                        advance();
+                        continue;
+                    }
+                    p = pi.postings + pi.skips[nb].offset;
+                    i = nb * SKIP_BLOCK;
+                    prev = 0;
+                }
+            }
+            advance();
+        }
+        return !done;
+    }
+
+    // Верхняя граница вклада в текущем блоке (Block-Max)
+    double block_max_score() const {
+        if (done) return 0;
+        const TermInfo& pi = tp.parts[part];
+        if (pi.skip_count > 0 && i > 0) {
+            int b = (i - 1) / SKIP_BLOCK;
+            if (b < pi.skip_count) return idf * pi.skips[b].max_tf;
+        }
+        return idf * pi.max_tf;
+    }
+
+    // Последний doc_id текущего блока (для коротких списков без
+    // скипов границы блока нет)
+    int block_last() const {
+        if (done) return INT_MAX;
+        const TermInfo& pi = tp.parts[part];
+        if (pi.skip_count > 0 && i > 0) {
+            int b = (i - 1) / SKIP_BLOCK;
+            if (b < pi.skip_count) return pi.skips[b].last_doc;
+        }
+        return INT_MAX;
+    }
+};
+
+// Ранжированный поиск: TF-IDF по схеме WAND (Weak-AND) с поблочными
+// максимумами. Вместо распаковки и оценки всего объединения списков
+// курсоры двигаются к пивоту — первому документу, у которого сумма
+// верхних границ вкладов термов превышает порог (минимум текущей
+// top-k кучи); документы, заведомо не попадающие в top-k, даже не
+// распаковываются. Поблочные максимумы из скипов дают второй, более
+// точный фильтр (Block-Max WAND)
+void search_ranked(const std::string& query, std::ostream& out, int k = 50) {
+    // Термы запроса
+    std::vector<TermCursor> cursors;
+    std::istringstream iss(query);
+    std::string term;
+    while (iss >> term) {
+        // Подстановка даёт по курсору на каждый терм диапазона —
+        // каждый со своим idf, как если бы их перечислили явно
+        std::vector<std::string> forms;
+        if (!term.empty() && term.back() == '*') {
+            forms = expand_prefix(term.substr(0, term.size() - 1));
+        } else {
+            forms.push_back(term);
+        }
+        for (const auto& form : forms) {
+            TermPostings info = find_term(form);
+            if (!info.found) continue;
+            cursors.emplace_back();
+            TermCursor& c = cursors.back();
+            c.tp = std::move(info);
+            c.idf = std::log((double)documents.size() / c.tp.doc_count);
+            int max_tf = 0;
+            for (const auto& part : c.tp.parts) {
+                max_tf = std::max(max_tf, part.max_tf);
+            }
+            c.max_score = c.idf * max_tf;
+            c.advance();
+        }
+    }
+
+    if (cursors.empty()) {
+        out << "Nothing found\n";
+        return;
+    }
+
+    StageTimer setop_timer(qt.setop); // WAND-обход — операция над списками
+
+    // min-куча из пар (score, doc_id): наверху худший из текущих top-k
+    using Scored = std::pair<double, int>;
+    std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> heap;
+    double threshold = -1; // порог входа в top-k
+
+    std::vector<TermCursor*> order;
+    size_t total_matched = 0; // документы, прошедшие до полной оценки
+    while (true) {
+        order.clear();
+        for (auto& c : cursors) {
+            if (!c.done) order.push_back(&c);
+        }
+        if (order.empty()) break;
+        std::sort(order.begin(), order.end(),
+                  [](TermCursor* a, TermCursor* b) { return a->doc < b->doc; });
+
+        // Пивот: первый курсор, на котором сумма верхних границ
+        // превышает порог
+        double ub = 0;
+        size_t pivot = order.size();
+        for (size_t j = 0; j < order.size(); ++j) {
+            ub += order[j]->max_score;
+            if (ub > threshold) { pivot = j; break; }
+        }
+        if (pivot == order.size()) break; // никто уже не пройдёт в top-k
+
+        int pivot_doc = order[pivot]->doc;
+        // Курсоры, стоящие на том же документе, тоже войдут в оценку
+        while (pivot + 1 < order.size() && order[pivot + 1]->doc == pivot_doc) {
+            pivot++;
+        }
+        if (order[0]->doc != pivot_doc) {
+            // Выравнивание: отстающие курсоры прыгают к пивоту
+            for (size_t j = 0; j < pivot; ++j) order[j]->seek(pivot_doc);
+            continue;
+        }
+
+        // Поблочная проверка: сумма максимумов текущих блоков
+        double block_ub = 0;
+        for (size_t j = 0; j <= pivot; ++j) block_ub += order[j]->block_max_score();
+        if (block_ub <= threshold) {
+            // Текущие блоки слабые — прыгаем за ближайшую границу блока
+            int border = INT_MAX;
+            for (size_t j = 0; j <= pivot; ++j) {
+                border = std::min(border, order[j]->block_last());
+            }
+            if (border == INT_MAX) {
+                // Одни короткие списки — границ блоков нет, просто шаг
+                order[0]->advance();
+            } else {
+                for (size_t j = 0; j <= pivot; ++j) order[j]->seek(border + 1);
+            }
+            continue;
+        }
+
+        // Полная оценка пивота
+        double score = 0;
+        for (auto* c : order) {
+            if (c->doc == pivot_doc) {
+                score += c->tf * c->idf;
+                c->advance();
+            }
+        }
+
+        total_matched++;
+        if ((int)heap.size() < k) {
+            heap.push({score, pivot_doc});
+        } else if (score > heap.top().first) {
+            heap.pop();
+            heap.push({score, pivot_doc});
+        }
+        if ((int)heap.size() == k) threshold = heap.top().first;
+    }
+
+    std::vector<Scored> top(heap.size());
+    for (size_t i = top.size(); i-- > 0; ) {
+        top[i] = heap.top();
+        heap.pop();
+    }
+
+    StageTimer format_timer(qt.format);
+    out << "Found " << total_matched << " documents, top " << top.size() << ":\n";
+    std::vector<std::string> terms = snippet_terms(query);
+    for (auto& [score, doc_id] : top) {
+        if (doc_id >= 0 && doc_id < (int)documents.size()) {
+            out << "- " << documents[doc_id] << " (score=" << score << ")\n";
+            print_snippet(out, doc_id, terms);
+        }
+    }
+}
+
+bool is_boolean_query(const std::string& query) {
+    for (char c : query) {
+        if (c == '&' || c == '|' || c == '!' || c == '(' || c == ')' ||
+            c == '"') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Обработка одного запроса с выводом в out; время раскладывается по
+// стадиям и попадает в гистограммы задержек
+void run_query(const std::string& query, std::ostream& out) {
+    if (query == "stats") {
+        print_latency_stats(out);
+        return;
+    }
+
+    qt = QueryTimings();
+    long long t0 = now_us();
+
+    if (is_boolean_query(query)) {
+        search_boolean(query, out);
+    } else if (query.find(' ') != std::string::npos) {
+        // Несколько термов без операторов — ранжированный поиск
+        search_ranked(query, out);
+    } else if (query.find('*') != std::string::npos) {
+        // Одиночная подстановка — через булев путь, где она
+        // раскрывается в OR по диапазону словаря
+        search_boolean(query, out);
+    } else {
+        search_single_term(query, out);
+    }
+
+    long long total = now_us() - t0;
+    hist_total.record(total);
+    hist_parse.record(total - qt.fetch - qt.setop - qt.format);
+    hist_fetch.record(qt.fetch);
+    hist_setop.record(qt.setop);
+    hist_format.record(qt.format);
+}
+
+// Режим сервера: индексы загружены один раз и после load_indexes()
+// неизменяемы (сегменты отображены PROT_READ, documents и segments_
+// никто не пишет), поэтому воркеры пула выполняют запросы параллельно
+// без блокировок; всё временное состояние запроса — DocList'ы,
+// принадлежащие QueryEvaluator, — живёт на стеке воркера.
+// Запросы приходят по TCP построчно, ответ — строки результата,
+// завершённые строкой "END"
+void handle_client(int fd) {
+    std::string buf;
+    char chunk[4096];
+
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) break;
+        buf.append(chunk, n);
+
+        size_t pos;
+        while ((pos = buf.find('\n')) != std::string::npos) {
+            std::string query = buf.substr(0, pos);
+            buf.erase(0, pos + 1);
+            if (!query.empty() && query.back() == '\r') query.pop_back();
+
+            std::ostringstream out;
+            run_query(query, out);
+            out << "END\n";
+
+            std::string resp = out.str();
+            size_t sent = 0;
+            while (sent < resp.size()) {
+                ssize_t w = write(fd, resp.data() + sent, resp.size() - sent);
+                if (w <= 0) { close(fd); return; }
+                sent += w;
+            }
+        }
+    }
+    close(fd);
+}
+
+// Очередь принятых соединений для пула воркеров; accept остаётся в
+// главном потоке, обработка запросов распределяется по ядрам
+std::deque<int> client_queue;
+std::mutex client_mutex;
+std::condition_variable client_cv;
+
+const size_t MAX_QUEUED_CLIENTS = 256;
+
+void server_worker_main() {
+    while (true) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(client_mutex);
+            client_cv.wait(lock, [] { return !client_queue.empty(); });
+            fd = client_queue.front();
+            client_queue.pop_front();
+        }
+        handle_client(fd);
+    }
+}
+
+int run_server(int port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Cannot create socket\n";
+        return 1;
+    }
+
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "Cannot bind port " << port << "\n";
+        return 1;
+    }
+    if (listen(listen_fd, 64) < 0) {
+        std::cerr << "Cannot listen on port " << port << "\n";
+        return 1;
+    }
+
+    std::cout << "Query server listening on port " << port << "\n";
+    std::cout << "Documents: " << documents.size() << "\n";
+    long long total_terms = 0;
+    for (const auto& seg : segments_) total_terms += seg.term_count;
+    std::cout << "Unique terms: " << total_terms << "\n";
+
+    unsigned num_workers = std::thread::hardware_concurrency();
+    if (num_workers == 0) num_workers = 4;
+    std::cout << "Worker threads: " << num_workers << "\n";
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < num_workers; ++i) {
+        workers.emplace_back(server_worker_main);
+    }
+
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        {
+            std::unique_lock<std::mutex> lock(client_mutex);
+            if (client_queue.size() >= MAX_QUEUED_CLIENTS) {
+                // Перегрузка: сбрасываем соединение, не копим очередь
+                lock.unlock();
+                close(fd);
+                continue;
+            }
+            client_queue.push_back(fd);
+        }
+        client_cv.notify_one();
+    }
+}
+
+// Режим координатора (--fanout): запрос рассылается шардовым
+// экземплярам движка (каждый — обычный engine --serve над своим
+// каталогом шарда, см. --shards в индексаторе) и ответы сливаются.
+// Диапазоны doc_id шардов не пересекаются, поэтому слияние булевых
+// результатов — конкатенация в порядке манифеста, а ранжированных —
+// сортировка строк по score с обрезкой до top-k. Локальные индексы
+// координатору не нужны
+
+struct ShardAddr {
+    std::string host;
+    int port;
+};
+
+// Список шардов: либо host:port через запятую, либо файл манифеста
+// со строкой host:port на шард
+std::vector<ShardAddr> parse_shard_list(const std::string& arg) {
+    std::string text = arg;
+    if (arg.find(':') == std::string::npos) {
+        std::ifstream in(arg);
+        std::ostringstream buf;
+        buf << in.rdbuf();
+        text = buf.str();
+        for (char& c : text) if (c == '\n') c = ',';
+    }
+
+    std::vector<ShardAddr> shards;
+    std::istringstream iss(text);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == std::string::npos || item.empty()) continue;
+        shards.push_back({item.substr(0, colon),
+                          std::atoi(item.c_str() + colon + 1)});
+    }
+    return shards;
+}
+
+// Один запрос к одному шарду по строчному протоколу сервера: строка
+// запроса, ответ до строки "END". Ошибка соединения — пустой ответ
+std::string shard_request(const ShardAddr& shard, const std::string& query) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    std::string port_str = std::to_string(shard.port);
+    if (getaddrinfo(shard.host.c_str(), port_str.c_str(), &hints, &res) != 0) {
+        std::cerr << "Cannot resolve shard " << shard.host << "\n";
+        return "";
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        std::cerr << "Cannot connect to shard " << shard.host << ":"
+                  << shard.port << "\n";
+        freeaddrinfo(res);
+        if (fd >= 0) close(fd);
+        return "";
+    }
+    freeaddrinfo(res);
+
+    std::string req = query + "\n";
+    size_t sent = 0;
+    while (sent < req.size()) {
+        ssize_t w = write(fd, req.data() + sent, req.size() - sent);
+        if (w <= 0) { close(fd); return ""; }
+        sent += w;
+    }
+
+    std::string resp;
+    char chunk[4096];
+    while (resp.rfind("END\n") != resp.size() - 4 || resp.size() < 4) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) break;
+        resp.append(chunk, n);
+    }
+    close(fd);
+
+    if (resp.size() >= 4 && resp.compare(resp.size() - 4, 4, "END\n") == 0) {
+        resp.resize(resp.size() - 4);
+    }
+    return resp;
+}
+
+// Рассылка запроса по шардам (поток на шард) и слияние ответов
+void fanout_query(const std::vector<ShardAddr>& shards,
+                  const std::string& query, std::ostream& out, int k = 50) {
+    std::vector<std::string> replies(shards.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        threads.emplace_back([&, i] {
+            replies[i] = shard_request(shards[i], query);
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    // Разбор ответов: строки "Found N ..." суммируются, строки
+    // результатов "- url[ (score=...)]" собираются для слияния
+    struct Hit {
+        double score;
+        std::string line;
+    };
+    std::vector<Hit> hits;
+    long long found = 0;
+    bool any_found = false;
+    bool ranked = false;
+    std::string other;
+
+    for (size_t i = 0; i < replies.size(); ++i) {
+        std::istringstream iss(replies[i]);
+        std::string line;
+        while (std::getline(iss, line)) {
+            if (line.compare(0, 6, "Found ") == 0) {
+                found += std::atoll(line.c_str() + 6);
+                any_found = true;
+            } else if (line.compare(0, 6, "Term: ") == 0) {
+                // Одно-термовый формат: счётчик в doc_count=
+                size_t p = line.rfind("doc_count=");
+                if (p != std::string::npos) {
+                    found += std::atoll(line.c_str() + p + 10);
+                }
+                any_found = true;
+            } else if (line == "Documents:") {
+                // заголовок одно-термового формата, не переносим
+            } else if (line.compare(0, 2, "- ") == 0) {
+                double score = 0;
+                size_t p = line.rfind(" (score=");
+                if (p != std::string::npos) {
+                    score = std::atof(line.c_str() + p + 8);
+                    ranked = true;
+                }
+                hits.push_back({score, line});
+            } else if (line.compare(0, 2, "  ") == 0 && !hits.empty()) {
+                // Сниппет относится к предыдущей строке результата
+                hits.back().line += "\n" + line;
+            } else if (line.compare(0, 8, "... and ") != 0 &&
+                       line != "Nothing found" && !line.empty()) {
+                // Нестандартный ответ (stats, ошибки) — выводим как есть
+                other += "shard " + shards[i].host + ":"
+                       + std::to_string(shards[i].port) + ": " + line + "\n";
+            }
+        }
+    }
+
+    if (!any_found && hits.empty()) {
+        out << (other.empty() ? "Nothing found\n" : other);
+        return;
+    }
+    out << other;
+
+    if (ranked) {
+        std::stable_sort(hits.begin(), hits.end(),
+                         [](const Hit& a, const Hit& b) {
+                             return a.score > b.score;
+                         });
+        if ((int)hits.size() > k) hits.resize(k);
+        out << "Found " << found << " documents, top " << hits.size() << ":\n";
+        for (const Hit& h : hits) out << h.line << "\n";
+    } else {
+        // Булев результат: шарды не пересекаются, порядок манифеста
+        // даёт возрастающие глобальные doc_id
+        out << "Found " << found << " documents:\n";
+        for (size_t i = 0; i < hits.size() && (int)i < k; ++i) {
+            out << hits[i].line << "\n";
+        }
+        if ((int)hits.size() > k) {
+            out << "... and " << (found - k) << " more documents\n";
+        }
+    }
+}
+
+int run_fanout(const std::string& shard_arg, const std::string& query) {
+    std::vector<ShardAddr> shards = parse_shard_list(shard_arg);
+    if (shards.empty()) {
+        std::cerr << "No shards in list: " << shard_arg << "\n";
+        return 1;
+    }
+    std::cout << "Coordinator over " << shards.size() << " shard(s)\n";
+
+    if (!query.empty()) {
+        fanout_query(shards, query, std::cout);
+        return 0;
+    }
+
+    std::string line;
+    std::cout << "Enter search query (empty to exit): ";
+    while (std::getline(std::cin, line)) {
+        if (line.empty()) break;
+        fanout_query(shards, line, std::cout);
+        std::cout << "\nEnter search query (empty to exit): ";
+    }
+    return 0;
+}
+
+// Бенчмарк (--bench): проигрывание лога запросов по загруженному
+// индексу. Запросы раздаются потокам по кругу (поток t берёт запросы
+// t, t+threads, ...), расписание прихода при заданном QPS считается
+// от общего старта — раскладка детерминированная, и два прогона
+// сравнимы между собой. Вывод запросов уходит в строковый буфер:
+// меряем движок, а не терминал. Отчёт — в bench.json, в духе
+// индексерного
+void bench_worker(const std::vector<std::string>* queries, int tid,
+                  int threads, double qps,
+                  std::chrono::steady_clock::time_point start,
+                  std::vector<long long>* latencies) {
+    for (size_t i = tid; i < queries->size(); i += threads) {
+        if (qps > 0) {
+            // Запрос номер i приходит в момент i/qps от старта
+            std::this_thread::sleep_until(
+                start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(i / qps)));
+        }
+        std::ostringstream sink;
+        long long t0 = now_us();
+        run_query((*queries)[i], sink);
+        latencies->push_back(now_us() - t0);
+    }
+}
+
+int run_bench(const char* log_file, int threads, double qps) {
+    std::ifstream in(log_file);
+    if (!in) {
+        std::cerr << "Cannot open query log: " << log_file << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> queries;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) queries.push_back(line);
+    }
+    if (queries.empty()) {
+        std::cerr << "Empty query log\n";
+        return 1;
+    }
+
+    // Раскладка по путям исполнения — для отчёта
+    long long n_boolean = 0, n_ranked = 0, n_single = 0;
+    for (const auto& q : queries) {
+        if (is_boolean_query(q)) n_boolean++;
+        else if (q.find(' ') != std::string::npos) n_ranked++;
+        else n_single++;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<long long>> lat_per_thread(threads);
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t) {
+        pool.emplace_back(bench_worker, &queries, t, threads, qps,
+                          start, &lat_per_thread[t]);
+    }
+    bench_worker(&queries, 0, threads, qps, start, &lat_per_thread[0]);
+    for (auto& t : pool) t.join();
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::vector<long long> lat;
+    for (auto& v : lat_per_thread) lat.insert(lat.end(), v.begin(), v.end());
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&](double p) {
+        size_t i = (size_t)(p * (lat.size() - 1));
+        return lat[i];
+    };
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru); // ru_maxrss на Linux — килобайты
+    double actual_qps = elapsed > 0 ? lat.size() / elapsed : 0;
+
+    std::ofstream out("bench.json");
+    out << "{"
+        << "\"queries\":" << lat.size() << ","
+        << "\"threads\":" << threads << ","
+        << "\"rate_limit_qps\":" << qps << ","
+        << "\"seconds\":" << elapsed << ","
+        << "\"qps\":" << actual_qps << ","
+        << "\"paths\":{"
+        << "\"boolean\":" << n_boolean << ","
+        << "\"ranked\":" << n_ranked << ","
+        << "\"single\":" << n_single
+        << "},"
+        << "\"latency_us\":{"
+        << "\"p50\":" << pct(0.50) << ","
+        << "\"p90\":" << pct(0.90) << ","
+        << "\"p95\":" << pct(0.95) << ","
+        << "\"p99\":" << pct(0.99) << ","
+        << "\"max\":" << lat.back()
+        << "},"
+        << "\"peak_rss_kb\":" << ru.ru_maxrss
+        << "}\n";
+    out.close();
+
+    std::cout << "Queries: " << lat.size()
+              << " (" << n_boolean << " boolean, " << n_ranked
+              << " ranked, " << n_single << " single)\n";
+    std::cout << "Threads: " << threads;
+    if (qps > 0) std::cout << ", arrival rate " << qps << " qps";
+    std::cout << "\n";
+    std::cout << "Time: " << elapsed << " sec (" << actual_qps << " qps)\n";
+    std::cout << "Latency us: p50=" << pct(0.50) << " p90=" << pct(0.90)
+              << " p95=" << pct(0.95) << " p99=" << pct(0.99)
+              << " max=" << lat.back() << "\n";
+    std::cout << "Peak RSS: " << ru.ru_maxrss / 1024.0 << " MB\n";
+    std::cout << "Report: bench.json\n";
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
-    // Загружаем индексы
-    load_forward("forward.idx");
-    load_inverted("inverted.idx");
+    // Режим координатора не трогает локальные индексы:
+    // engine --fanout host:port[,host:port...] [запрос]
+    if (argc > 2 && std::string(argv[1]) == "--fanout") {
+        std::string query;
+        for (int i = 3; i < argc; i++) {
+            if (i > 3) query += " ";
+            query += argv[i];
+        }
+        return run_fanout(argv[2], query);
+    }
+
+    // Бюджет кэша результатов в мегабайтах
+    if (const char* mb = std::getenv("ENGINE_CACHE_MB")) {
+        cache_budget = static_cast<size_t>(std::atoll(mb)) << 20;
+    }
+
+    // Бюджет кэша распакованных постингов в мегабайтах
+    if (const char* mb = std::getenv("ENGINE_POSTING_CACHE_MB")) {
+        posting_cache_budget = static_cast<size_t>(std::atoll(mb)) << 20;
+    }
+
+    // Загружаем индексы (сегменты из манифеста или одиночные файлы)
+    load_indexes();
+
+    if (argc > 1 && std::string(argv[1]) == "--serve") {
+        // Режим сервера: engine --serve [port]
+        int port = (argc > 2) ? std::atoi(argv[2]) : 7070;
+        return run_server(port);
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--bench") {
+        // Бенчмарк: engine --bench <лог запросов> [потоки] [qps]
+        int threads = (argc > 3) ? std::max(1, std::atoi(argv[3])) : 1;
+        double qps = (argc > 4) ? std::atof(argv[4]) : 0;
+        return run_bench(argv[2], threads, qps);
+    }
 
     if (argc > 1) {
         std::string query;
@@ -375,29 +2551,18 @@ int main(int argc, char* argv[]) {
             query += argv[i];
         }
 
-        // Определяем тип запроса
-        bool is_simple = true;
-        for (char c : query) {
-            if (c == '&' || c == '|' || c == '!' || c == '(' || c == ')') {
-                is_simple = false;
-                break;
-            }
-        }
-
-        if (is_simple) {
-            // Простой однотермовый запрос
-            search_single_term(query);
-        } else {
-            // Булев запрос
-            search_boolean(query);
-        }
+        run_query(query, std::cout);
     } else {
         std::cout << "Search engine loaded.\n";
         std::cout << "Documents: " << documents.size() << "\n";
-        std::cout << "Unique terms: " << hash_table.size() << "\n\n";
+        long long total_terms = 0;
+        for (const auto& seg : segments_) total_terms += seg.term_count;
+        std::cout << "Unique terms: " << total_terms << "\n\n";
 
         std::cout << "Usage:\n";
         std::cout << "  - Single term: матч\n";
+        std::cout << "  - Ranked (TF-IDF): матч футбол гол\n";
+        std::cout << "  - Phrase (needs positional index): \"чемпионат мира\"\n";
         std::cout << "  - AND operation: матч && футбол\n";
         std::cout << "  - OR operation: матч || игра\n";
         std::cout << "  - NOT operation: !теннис\n";
@@ -411,27 +2576,26 @@ int main(int argc, char* argv[]) {
         while (std::getline(std::cin, query)) {
             if (query.empty()) break;
 
-            bool is_simple = true;
-            for (char c : query) {
-                if (c == '&' || c == '|' || c == '!' || c == '(' || c == ')') {
-                    is_simple = false;
-                    break;
-                }
-            }
-
-            if (is_simple) {
-                search_single_term(query);
-            } else {
-                search_boolean(query);
-            }
+            run_query(query, std::cout);
 
             std::cout << "\nEnter search query (empty to exit): ";
         }
     }
 
-    // Очистка памяти
-    for (auto& entry : hash_table) {
-        delete entry.second;
+    // Дамп гистограмм на выходе (в stderr, чтобы не мешать выводу)
+    if (hist_total.total.load() > 0) {
+        print_latency_stats(std::cerr);
+    }
+
+    // Секции снимка живут в его общем отображении (file_size == 0)
+    for (auto& seg : segments_) {
+        if (seg.file_size) munmap(const_cast<char*>(seg.base), seg.file_size);
+    }
+    if (docstore.base && docstore.file_size) {
+        munmap(const_cast<char*>(docstore.base), docstore.file_size);
+    }
+    if (snapshot_base) {
+        munmap(const_cast<char*>(snapshot_base), snapshot_size);
     }
 
     return 0;
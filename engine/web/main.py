@@ -1,4 +1,5 @@
 import os
+import socket
 import subprocess
 import urllib.parse
 from http.server import BaseHTTPRequestHandler, HTTPServer
@@ -8,6 +9,25 @@ ENGINE_PATH = os.path.join(BASE_DIR, "engine")
 FORWARD_IDX = os.path.join(BASE_DIR, "forward.idx")
 INVERTED_IDX = os.path.join(BASE_DIR, "inverted.idx")
 
+# Порт постоянного сервера запросов (engine --serve)
+ENGINE_PORT = int(os.environ.get("ENGINE_PORT", "7070"))
+
+
+def query_engine_server(query):
+    """Запрос к постоянному серверу: строка запроса, ответ до строки END."""
+    with socket.create_connection(("127.0.0.1", ENGINE_PORT), timeout=5) as sock:
+        sock.sendall(query.encode("utf-8") + b"\n")
+        data = b""
+        while not data.endswith(b"\nEND\n") and data != b"END\n":
+            chunk = sock.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+    text = data.decode("utf-8", errors="replace")
+    if text.endswith("END\n"):
+        text = text[: -len("END\n")]
+    return text
+
 
 class Handler(BaseHTTPRequestHandler):
     def do_GET(self):
@@ -31,7 +51,19 @@ class Handler(BaseHTTPRequestHandler):
                 print(f"Поисковый запрос: '{query}'")
 
                 try:
-                    if not os.path.exists(ENGINE_PATH):
+                    # Сначала пробуем постоянный сервер запросов — он
+                    # держит индексы в памяти и отвечает за микросекунды
+                    try:
+                        output = query_engine_server(query)
+                        html += f"<h3>Результаты для '{query}':</h3>"
+                        html += f"<pre>{output}</pre>"
+                        served = True
+                    except OSError:
+                        served = False
+
+                    if served:
+                        pass
+                    elif not os.path.exists(ENGINE_PATH):
                         html += "<p style='color:red'>Файл engine не найден</p>"
                     elif not os.path.exists(FORWARD_IDX):
                         html += "<p style='color:red'>Файл forward.idx не найден</p>"
@@ -1,18 +1,43 @@
 #include <iostream>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <cctype>
-#include <ctime>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Структуры данных
+#ifdef WITH_POSITIONS
+// Позиция токена в документе (номер проиндексированного токена);
+// список строится prepend-ом, как и списки документов
+struct PosNode {
+    int pos;
+    PosNode* next;
+};
+#endif
+
 struct DocNode {
     int doc_id;
+    int tf; // число вхождений терма в документ
     DocNode* next;
+#ifdef WITH_POSITIONS
+    PosNode* positions = nullptr; // позиции вхождений, в обратном порядке
+#endif
 };
 
 struct TermEntry {
@@ -36,24 +61,357 @@ struct Stats {
     long long total_unique_terms = 0;
 };
 
-// Глобальные переменные
-std::unordered_map<std::string, TermEntry*> hash_table;
+// Бенчмарк-режим (--bench): корпус проигрывается из файла с заданной
+// скоростью подачи, стадии конвейера меряются в тактах процессора.
+// Счётчики вложенные: ingest включает tokenize, tokenize — stem и
+// term_insert, term_insert — posting_append; чистое время каждой
+// стадии вычитается при выводе отчёта
+struct BenchCounters {
+    unsigned long long ingest = 0;         // разбор JSON + токенизация
+    unsigned long long tokenize = 0;       // feed токенизатора целиком
+    unsigned long long stem = 0;
+    unsigned long long term_insert = 0;    // add_term вместе с add_doc
+    unsigned long long posting_append = 0; // только add_doc
+    unsigned long long serialize = 0;
+};
+
+BenchCounters bench;
+bool bench_mode = false;
+double bench_rate_mb = 0; // целевая скорость подачи, МБ/с (0 — без лимита)
+
+inline unsigned long long bench_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return static_cast<unsigned long long>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// Арена для TermEntry и DocNode: память берётся мегабайтными блоками
+// бамп-аллокатором, так что построение индекса не делает по malloc на
+// постинг, а освобождение — несколько delete[] вместо миллионов delete
+class Arena {
+public:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    void* alloc(size_t size, size_t align) {
+        used_ = (used_ + align - 1) & ~(align - 1);
+        if (blocks_.empty() || used_ + size > BLOCK_SIZE) {
+            blocks_.push_back(new char[BLOCK_SIZE]);
+            used_ = 0;
+        }
+        void* p = blocks_.back() + used_;
+        used_ += size;
+        return p;
+    }
+
+    ~Arena() {
+        for (char* b : blocks_) delete[] b;
+    }
+
+private:
+    std::vector<char*> blocks_;
+    size_t used_ = 0;
+};
+
+// Стемминг: алгоритм Snowball для русского языка. Кириллица в UTF-8
+// двухбайтовая, поэтому суффиксы сравниваются как байтовые строки, а
+// области RV/R2 считаются в байтовых смещениях. Слово усекается на
+// месте (resize), временных строк стеммер не создаёт
+
+struct Suffix {
+    const char* text;
+    size_t len;
+    bool after_a_ya; // суффикс срабатывает только после а/я (она остаётся)
+};
+
+#define SUF(s) { s, sizeof(s) - 1, false }
+#define SUF_AY(s) { s, sizeof(s) - 1, true }
+
+// Списки Snowball, в каждом длинные суффиксы раньше коротких
+const Suffix PERFECTIVE_GERUND[] = {
+    SUF("ившись"), SUF("ывшись"), SUF_AY("вшись"), SUF("ивши"), SUF("ывши"),
+    SUF_AY("вши"), SUF("ив"), SUF("ыв"), SUF_AY("в"),
+};
+const Suffix REFLEXIVE[] = { SUF("ся"), SUF("сь") };
+const Suffix ADJECTIVE[] = {
+    SUF("ими"), SUF("ыми"), SUF("его"), SUF("ого"), SUF("ему"), SUF("ому"),
+    SUF("ее"), SUF("ие"), SUF("ые"), SUF("ое"), SUF("ей"), SUF("ий"),
+    SUF("ый"), SUF("ой"), SUF("ем"), SUF("им"), SUF("ым"), SUF("ом"),
+    SUF("их"), SUF("ых"), SUF("ую"), SUF("юю"), SUF("ая"), SUF("яя"),
+    SUF("ою"), SUF("ею"),
+};
+const Suffix PARTICIPLE[] = {
+    SUF("ивш"), SUF("ывш"), SUF("ующ"), SUF_AY("ем"), SUF_AY("нн"),
+    SUF_AY("вш"), SUF_AY("ющ"), SUF_AY("щ"),
+};
+const Suffix VERB[] = {
+    SUF("ейте"), SUF("уйте"), SUF("ила"), SUF("ыла"), SUF("ена"),
+    SUF("ите"), SUF("или"), SUF("ыли"), SUF("ило"), SUF("ыло"),
+    SUF("ено"), SUF("ует"), SUF("уют"), SUF("ены"), SUF("ить"),
+    SUF("ыть"), SUF("ишь"), SUF_AY("ете"), SUF_AY("йте"), SUF_AY("ешь"),
+    SUF_AY("нно"), SUF_AY("ла"), SUF_AY("на"), SUF_AY("ли"), SUF_AY("ем"),
+    SUF_AY("ло"), SUF_AY("но"), SUF_AY("ет"), SUF_AY("ют"), SUF_AY("ны"),
+    SUF_AY("ть"), SUF("ей"), SUF("уй"), SUF("ил"), SUF("ыл"), SUF("им"),
+    SUF("ым"), SUF("ен"), SUF("ят"), SUF("ит"), SUF("ыт"), SUF("ую"),
+    SUF_AY("й"), SUF_AY("л"), SUF_AY("н"), SUF("ю"),
+};
+const Suffix NOUN[] = {
+    SUF("иями"), SUF("ями"), SUF("ами"), SUF("ией"), SUF("иям"),
+    SUF("ием"), SUF("иях"), SUF("ие"), SUF("ье"), SUF("еи"), SUF("ии"),
+    SUF("ей"), SUF("ой"), SUF("ий"), SUF("ям"), SUF("ем"), SUF("ам"),
+    SUF("ом"), SUF("ах"), SUF("ях"), SUF("ию"), SUF("ью"), SUF("ия"),
+    SUF("ья"), SUF("ев"), SUF("ов"), SUF("а"), SUF("е"), SUF("и"),
+    SUF("й"), SUF("о"), SUF("у"), SUF("ы"), SUF("ь"), SUF("ю"), SUF("я"),
+};
+const Suffix DERIVATIONAL[] = { SUF("ость"), SUF("ост") };
+const Suffix SUPERLATIVE[] = { SUF("ейше"), SUF("ейш") };
+
+#undef SUF
+#undef SUF_AY
+
+// Гласная ли кириллическая буква по байтовому смещению
+bool is_vowel_at(const std::string& w, size_t i) {
+    if (i + 1 >= w.size()) return false;
+    unsigned char b0 = w[i], b1 = w[i + 1];
+    if (b0 == 0xD0) {
+        return b1 == 0xB0 || b1 == 0xB5 || b1 == 0xB8 || b1 == 0xBE; // а е и о
+    }
+    if (b0 == 0xD1) {
+        return b1 == 0x83 || b1 == 0x8B || b1 == 0x8D ||
+               b1 == 0x8E || b1 == 0x8F; // у ы э ю я
+    }
+    return false;
+}
+
+// Границы областей Snowball в байтах: RV — после первой гласной,
+// R2 — после первой согласной за гласной внутри R1
+void stem_regions(const std::string& w, size_t& rv, size_t& r2) {
+    size_t n = w.size();
+    rv = r2 = n;
+
+    auto step = [&](size_t i) { return (w[i] & 0x80) ? (size_t)2 : (size_t)1; };
+
+    size_t i = 0;
+    while (i < n && !is_vowel_at(w, i)) i += step(i);
+    if (i >= n) return;
+    rv = i + 2;
+
+    // R1, затем R2 по той же схеме гласная -> согласная
+    i = rv;
+    while (i < n && is_vowel_at(w, i)) i += step(i);
+    if (i >= n) return;
+    size_t r1 = i + step(i);
+
+    i = r1;
+    while (i < n && !is_vowel_at(w, i)) i += step(i);
+    while (i < n && is_vowel_at(w, i)) i += step(i);
+    if (i >= n) return;
+    r2 = i + step(i);
+}
+
+// Снятие самого длинного подходящего суффикса из списка; суффикс
+// должен целиком лежать в области, начинающейся с limit
+template <size_t N>
+bool strip_suffix(std::string& w, size_t limit, const Suffix (&sufs)[N]) {
+    for (size_t i = 0; i < N; ++i) {
+        const Suffix& s = sufs[i];
+        if (w.size() < s.len + limit) continue;
+        size_t p = w.size() - s.len;
+        if (std::memcmp(w.data() + p, s.text, s.len) != 0) continue;
+        if (s.after_a_ya) {
+            if (p < limit + 2) continue;
+            if (std::memcmp(w.data() + p - 2, "а", 2) != 0 &&
+                std::memcmp(w.data() + p - 2, "я", 2) != 0) continue;
+        }
+        w.resize(p);
+        return true;
+    }
+    return false;
+}
+
+void stem_in_place(std::string& w) {
+    size_t rv, r2;
+    stem_regions(w, rv, r2);
+    if (rv >= w.size()) return; // гласных нет — стеммеру нечего делать
+
+    auto ends = [&](const char* s, size_t len) {
+        return w.size() >= len + rv &&
+               std::memcmp(w.data() + w.size() - len, s, len) == 0;
+    };
+
+    // Шаг 1: деепричастие, иначе возвратный суффикс и затем
+    // прилагательное (с причастием) | глагол | существительное
+    if (!strip_suffix(w, rv, PERFECTIVE_GERUND)) {
+        strip_suffix(w, rv, REFLEXIVE);
+        if (strip_suffix(w, rv, ADJECTIVE)) {
+            strip_suffix(w, rv, PARTICIPLE);
+        } else if (!strip_suffix(w, rv, VERB)) {
+            strip_suffix(w, rv, NOUN);
+        }
+    }
+
+    // Шаг 2: конечная "и"
+    if (ends("и", 2)) w.resize(w.size() - 2);
+
+    // Шаг 3: деривационный суффикс в R2
+    strip_suffix(w, r2, DERIVATIONAL);
+
+    // Шаг 4: "нн" -> "н", превосходная степень, мягкий знак
+    if (ends("нн", 4)) {
+        w.resize(w.size() - 2);
+    } else if (strip_suffix(w, rv, SUPERLATIVE)) {
+        if (ends("нн", 4)) w.resize(w.size() - 2);
+    } else if (ends("ь", 2)) {
+        w.resize(w.size() - 2);
+    }
+}
+
+// Кэш стемминга с прямым отображением: токены распределены по Ципфу,
+// так что почти каждое обращение попадает в уже стеммированную запись
+// и не доходит ни до стеммера, ни до аллокаций. Коллизия просто
+// перезаписывает запись — горячие токены всё равно удерживают свои
+struct StemCache {
+    static const size_t SIZE = 1 << 16; // степень двойки
+
+    struct Entry {
+        std::string token;
+        std::string stem;
+    };
+    std::vector<Entry> entries{SIZE};
+
+    const std::string& stem_token(std::string_view token) {
+        size_t h = std::hash<std::string_view>{}(token) & (SIZE - 1);
+        Entry& e = entries[h];
+        if (e.token == token) return e.stem; // попадание
+        e.token.assign(token.data(), token.size());
+        e.stem.assign(token.data(), token.size());
+        stem_in_place(e.stem);
+        return e.stem;
+    }
+};
+
+// Локальная таблица термов одного воркера; в параллельном режиме
+// каждый воркер пишет только в свою, без блокировок на горячем пути
+struct IndexShard {
+    std::unordered_map<std::string_view, TermEntry*> table;
+    Stats stats;
+    Arena arena;
+    StemCache stem_cache;
+};
+
+// Глобальные переменные.
+// Таблицы термов интернируют строки: ключ — string_view на байты
+// term внутри самого TermEntry, так что байты каждого терма хранятся
+// ровно один раз. TermEntry живут в аренах и не перемещаются, поэтому
+// view остаются валидными
+std::unordered_map<std::string_view, TermEntry*> hash_table;
 std::vector<Document> documents;
 Stats stats;
 
-bool is_valid_char(char c) {
-    unsigned char uc = static_cast<unsigned char>(c);
+// Хранилище текстов (--store): очищенный текст каждого документа для
+// сниппетов в движке. Тексты накапливаются в памяти и сериализуются
+// сжатыми блоками в docstore.idx. В параллельном режиме воркеры
+// складывают тексты под store_mutex
+bool store_mode = false;
+std::vector<std::string> doc_texts;
+std::mutex store_mutex;
 
-    if (uc >= '0' && uc <= '9') return true;
+// Дедупликация (--dedup): на документ считается 64-битный SimHash по
+// токенам, и документ, отличающийся от уже виденного не более чем на
+// DEDUP_HAMMING бит, в индекс не попадает — в forward.idx пишется
+// ссылка на канонический doc_id. Поиск кандидатов — по четырём
+// 16-битным полосам отпечатка: при расстоянии <= 3 хотя бы одна
+// полоса совпадает точно
+bool dedup_mode = false;
+const int DEDUP_HAMMING = 3;
+const int DEDUP_MIN_TOKENS = 8; // короткие страницы не сравниваем
+std::vector<unsigned long long> doc_fingerprints; // по doc_id
+std::vector<int> doc_aliases;                     // канонический doc_id или -1
+std::unordered_map<unsigned short, std::vector<int>> dedup_bands[4];
+std::mutex dedup_mutex;
 
-    if (uc == 0xD0 || uc == 0xD1) {
-        return true;
+inline unsigned long long fnv64(std::string_view s) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
     }
+    return h;
+}
 
-    return false;
+// Накопитель SimHash: каждый токен голосует своим хешем за биты
+struct SimHash {
+    int counts[64] = {};
+    int tokens = 0;
+
+    void add(std::string_view token) {
+        unsigned long long h = fnv64(token);
+        for (int b = 0; b < 64; ++b) {
+            counts[b] += (h >> b) & 1 ? 1 : -1;
+        }
+        tokens++;
+    }
+
+    unsigned long long value() const {
+        unsigned long long fp = 0;
+        for (int b = 0; b < 64; ++b) {
+            if (counts[b] > 0) fp |= 1ULL << b;
+        }
+        return fp;
+    }
+
+    void reset() {
+        std::memset(counts, 0, sizeof(counts));
+        tokens = 0;
+    }
+};
+
+// Регистрация отпечатка документа. Возвращает канонический doc_id,
+// если документ — почти дубликат уже виденного, иначе -1 (документ
+// становится каноническим сам)
+int register_fingerprint(int doc_id, const SimHash& sh) {
+    if (sh.tokens < DEDUP_MIN_TOKENS) return -1;
+    unsigned long long fp = sh.value();
+
+    std::lock_guard<std::mutex> lock(dedup_mutex);
+    if ((int)doc_aliases.size() <= doc_id) {
+        doc_aliases.resize(doc_id + 1, -1);
+        doc_fingerprints.resize(doc_id + 1, 0);
+    }
+    doc_fingerprints[doc_id] = fp;
+
+    for (int band = 0; band < 4; ++band) {
+        unsigned short key = (unsigned short)(fp >> (16 * band));
+        auto it = dedup_bands[band].find(key);
+        if (it == dedup_bands[band].end()) continue;
+        for (int cand : it->second) {
+            if (cand == doc_id) continue;
+            if (__builtin_popcountll(fp ^ doc_fingerprints[cand])
+                    <= DEDUP_HAMMING) {
+                doc_aliases[doc_id] = cand;
+                return cand;
+            }
+        }
+    }
+
+    for (int band = 0; band < 4; ++band) {
+        unsigned short key = (unsigned short)(fp >> (16 * band));
+        dedup_bands[band][key].push_back(doc_id);
+    }
+    return -1;
+}
+
+// Байт принадлежит токену: цифра, ведущий байт кириллицы (0xD0/0xD1)
+// или байт продолжения UTF-8
+bool is_token_byte(unsigned char c) {
+    if (c >= '0' && c <= '9') return true;
+    if ((c & 0xC0) == 0x80) return true;
+    return c == 0xD0 || c == 0xD1;
 }
 
-bool is_pure_number(const std::string& token) {
+bool is_pure_number(std::string_view token) {
     for (char c : token) {
         if (!(c >= '0' && c <= '9')) {
             unsigned char uc = static_cast<unsigned char>(c);
@@ -65,11 +423,11 @@ bool is_pure_number(const std::string& token) {
     return true;
 }
 
-bool should_skip_token(const std::string& token) {
+bool should_skip_token(std::string_view token) {
     if (token.empty()) return true;
     if (token.size() == 1 && !std::isalpha(static_cast<unsigned char>(token[0]))) return true;
 
-    static const std::unordered_set<std::string> stop_tokens = {
+    static const std::unordered_set<std::string_view> stop_tokens = {
         "quot", "amp", "lt", "gt", "nbsp",
         "http", "https", "www", "com", "ru", "org", "n",
         "class", "quotquot", "a", "navlist", "div", "link", "span"
@@ -78,204 +436,1628 @@ bool should_skip_token(const std::string& token) {
     return stop_tokens.count(token) > 0 || is_pure_number(token);
 }
 
-// Стемминг
-std::string stem(const std::string& token) {
-    std::string t = token;
-    if (t.size() > 2) {
-        if (t.size() > 4 && t.substr(t.size()-2) == "ов") t = t.substr(0, t.size()-2);
-        else if (t.size() > 4 && t.substr(t.size()-2) == "ев") t = t.substr(0, t.size()-2);
-        else if (t.size() > 4 && t.substr(t.size()-2) == "ам") t = t.substr(0, t.size()-2);
-        else if (t.size() > 4 && t.substr(t.size()-2) == "ём") t = t.substr(0, t.size()-2);
-    }
-    return t;
-}
+// Добавление документа к терму; pos — номер токена в документе,
+// используется только при сборке с -DWITH_POSITIONS
+void add_doc(Arena& arena, TermEntry* t, int doc_id, int pos) {
+    unsigned long long t0 = bench_mode ? bench_now() : 0;
 
-// Добавление документа к терму
-void add_doc(TermEntry* t, int doc_id) {
     DocNode* n = t->docs;
-    while (n) {
-        if (n->doc_id == doc_id) return;
-        n = n->next;
+    while (n && n->doc_id != doc_id) n = n->next;
+
+    if (n) {
+        n->tf++;
+#ifdef WITH_POSITIONS
+        n->positions = new (arena.alloc(sizeof(PosNode), alignof(PosNode)))
+            PosNode{pos, n->positions};
+#endif
+    } else {
+        n = new (arena.alloc(sizeof(DocNode), alignof(DocNode))) DocNode{doc_id, 1, t->docs};
+#ifdef WITH_POSITIONS
+        n->positions = new (arena.alloc(sizeof(PosNode), alignof(PosNode)))
+            PosNode{pos, nullptr};
+#endif
+        t->docs = n;
+        t->doc_count++;
     }
-    n = new DocNode{doc_id, t->docs};
-    t->docs = n;
-    t->doc_count++;
+
+    if (bench_mode) bench.posting_append += bench_now() - t0;
 }
 
-// Добавление терма
-void add_term(const std::string& token, int doc_id) {
-    auto it = hash_table.find(token);
-    if (it != hash_table.end()) {
+// Добавление терма. В горячем пути строка не копируется: поиск идёт
+// по string_view, копия байтов делается один раз при первой встрече
+// терма, и ключом таблицы становится view на эту копию
+void add_term(IndexShard& shard, std::string_view token, int doc_id, int pos) {
+    auto it = shard.table.find(token);
+    if (it != shard.table.end()) {
         it->second->freq++;
-        add_doc(it->second, doc_id);
+        add_doc(shard.arena, it->second, doc_id, pos);
         return;
     }
-    TermEntry* e = new TermEntry();
+    TermEntry* e = new (shard.arena.alloc(sizeof(TermEntry), alignof(TermEntry))) TermEntry();
     e->term = token;
     e->freq = 1;
     e->doc_count = 0;
     e->docs = nullptr;
-    add_doc(e, doc_id);
-    hash_table[token] = e;
-    stats.total_unique_terms++;
+    add_doc(shard.arena, e, doc_id, pos);
+    shard.table[std::string_view(e->term)] = e;
+    shard.stats.total_unique_terms++;
 }
 
-//Токенизация
-void process_html(const std::string& html, int doc_id) {
-    std::string token;
-    stats.total_input_bytes += html.size();
+// Поиск первой позиции >= i, где принадлежность байта токену равна
+// want; классификация идёт по 16 байт за инструкцию через SSE2
+size_t find_boundary(const unsigned char* data, size_t n, size_t i, bool want) {
+#ifdef __SSE2__
+    const __m128i zero_char = _mm_set1_epi8('0' - 1);
+    const __m128i nine_char = _mm_set1_epi8('9' + 1);
+    const __m128i cont_max  = _mm_set1_epi8(-64); // 0xC0
+    const __m128i d0 = _mm_set1_epi8((char)0xD0);
+    const __m128i d1 = _mm_set1_epi8((char)0xD1);
 
-    for (size_t i = 0; i < html.size(); ++i) {
-        unsigned char c = html[i];
-        if ((c & 0xC0) == 0x80) {
-            token += c;
-            continue;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+        // цифры '0'..'9'
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, zero_char),
+                                      _mm_cmplt_epi8(v, nine_char));
+        // байты продолжения UTF-8: 0x80..0xBF, в знаковом виде < -64
+        __m128i cont = _mm_cmplt_epi8(v, cont_max);
+        // ведущие байты кириллицы
+        __m128i lead = _mm_or_si128(_mm_cmpeq_epi8(v, d0), _mm_cmpeq_epi8(v, d1));
+
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(digit, _mm_or_si128(cont, lead)));
+        if (!want) mask = ~mask & 0xFFFF;
+
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < n && is_token_byte(data[i]) != want) i++;
+    return i;
+}
+
+//Токенизация: границы токенов ищутся пачками, сами токены передаются
+// дальше как string_view на входной буфер без посимвольной сборки
+void process_html(IndexShard& shard, const std::string& html, int doc_id) {
+    shard.stats.total_input_bytes += html.size();
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(html.data());
+    size_t n = html.size();
+    size_t i = 0;
+    int token_pos = 0; // позиции считаются по проиндексированным токенам
+    std::string text; // очищенный текст документа для хранилища
+
+    if (dedup_mode) {
+        // Первый проход — только отпечаток: решение «дубликат или нет»
+        // нужно до того, как термы попадут в таблицы
+        SimHash sh;
+        while (i < n) {
+            size_t start = find_boundary(data, n, i, true);
+            if (start >= n) break;
+            size_t end = find_boundary(data, n, start, false);
+            std::string_view token(html.data() + start, end - start);
+            if (!should_skip_token(token)) sh.add(token);
+            i = end;
         }
+        if (register_fingerprint(doc_id, sh) >= 0) {
+            // Почти дубликат — ни термов, ни текста, но запись в
+            // хранилище остаётся (пустая), чтобы doc_id сходились
+            if (store_mode) {
+                std::lock_guard<std::mutex> lock(store_mutex);
+                if ((int)doc_texts.size() <= doc_id) doc_texts.resize(doc_id + 1);
+            }
+            return;
+        }
+        i = 0;
+    }
 
-        if (is_valid_char(html[i])) {
-            token += html[i];
-        } else if (!token.empty() && !should_skip_token(token)) {
-            std::string t = stem(token);
-            add_term(t, doc_id);
-            stats.total_tokens++;
-            stats.total_token_length += t.size();
-            token.clear();
+    while (i < n) {
+        size_t start = find_boundary(data, n, i, true);
+        if (start >= n) break;
+        size_t end = find_boundary(data, n, start, false);
+
+        std::string_view token(html.data() + start, end - start);
+        if (store_mode) {
+            // В текст попадают и токены, которые индекс пропускает, —
+            // сниппет должен читаться как связный текст
+            text.append(token);
+            text.push_back(' ');
+        }
+        if (!should_skip_token(token)) {
+            const std::string& t = shard.stem_cache.stem_token(token);
+            add_term(shard, t, doc_id, token_pos++);
+            shard.stats.total_tokens++;
+            shard.stats.total_token_length += t.size();
         }
+        i = end;
     }
-    if (!token.empty() && !should_skip_token(token)) {
-        std::string t = stem(token);
-        add_term(t, doc_id);
-        stats.total_tokens++;
-        stats.total_token_length += t.size();
+
+    if (store_mode) {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        if ((int)doc_texts.size() <= doc_id) doc_texts.resize(doc_id + 1);
+        doc_texts[doc_id] = std::move(text);
     }
 }
 
-// Парсер JSON
-bool extract(const std::string& json, const std::string& field, std::string& out) {
-    std::string search = "\"" + field + "\":\"";
-    size_t pos = json.find(search);
-    if (pos == std::string::npos) return false;
-    pos += search.size();
+// Конвейер параллельной индексации: читатель нарезает входной поток
+// на пакеты документов, воркеры токенизируют каждый в свой шард
+struct DocBatch {
+    std::vector<std::pair<int, std::string>> docs; // doc_id, html
+};
+
+std::deque<DocBatch> batch_queue;
+std::mutex queue_mutex;
+std::condition_variable queue_cv; // есть работа
+std::condition_variable space_cv; // есть место в очереди
+bool input_done = false;
 
-    size_t end = pos;
-    while (end < json.size()) {
-        if (json[end] == '\"' && (end == 0 || json[end-1] != '\\')) {
-            break;
+const size_t MAX_QUEUED_BATCHES = 64;
+const size_t BATCH_SIZE = 256;
+
+void push_batch(DocBatch&& batch) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    space_cv.wait(lock, []{ return batch_queue.size() < MAX_QUEUED_BATCHES; });
+    batch_queue.push_back(std::move(batch));
+    queue_cv.notify_one();
+}
+
+void worker_main(IndexShard* shard) {
+    while (true) {
+        DocBatch batch;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, []{ return !batch_queue.empty() || input_done; });
+            if (batch_queue.empty()) return;
+            batch = std::move(batch_queue.front());
+            batch_queue.pop_front();
+            space_cv.notify_one();
+        }
+        for (auto& [doc_id, html] : batch.docs) {
+            process_html(*shard, html, doc_id);
         }
-        end++;
     }
+}
+
+// Слияние таблиц воркеров в итоговую hash_table.
+// Каждый документ обработан ровно одним воркером, поэтому списки
+// постингов из разных шардов не пересекаются. Записи остаются в аренах
+// своих шардов; пересобранные списки берут узлы из merge_arena
+Arena merge_arena;
 
-    if (end == json.size()) return false;
-    out = json.substr(pos, end - pos);
+void merge_shards(std::vector<IndexShard>& shards) {
+    std::vector<std::pair<int, DocNode*>> postings; // doc_id, исходный узел
 
-    size_t esc_pos = 0;
-    while ((esc_pos = out.find("\\\"", esc_pos)) != std::string::npos) {
-        out.replace(esc_pos, 2, "\"");
-        esc_pos++;
+    for (auto& shard : shards) {
+        for (auto& [term, e] : shard.table) {
+            auto it = hash_table.find(term);
+            if (it == hash_table.end()) {
+                hash_table[term] = e;
+                continue;
+            }
+
+            TermEntry* dst = it->second;
+            dst->freq += e->freq;
+
+            // Пересобираем общий список в убывающем порядке doc_id,
+            // как его строит add_doc
+            postings.clear();
+            for (DocNode* n = dst->docs; n; n = n->next) postings.push_back({n->doc_id, n});
+            for (DocNode* n = e->docs; n; n = n->next) postings.push_back({n->doc_id, n});
+            std::sort(postings.begin(), postings.end());
+
+            dst->docs = nullptr;
+            for (auto& [id, src] : postings) {
+                DocNode* n = new (merge_arena.alloc(sizeof(DocNode), alignof(DocNode)))
+                    DocNode{id, src->tf, dst->docs};
+#ifdef WITH_POSITIONS
+                n->positions = src->positions; // позиции остаются в арене шарда
+#endif
+                dst->docs = n;
+            }
+            dst->doc_count = static_cast<int>(postings.size());
+        }
+        shard.table.clear();
+
+        stats.total_tokens += shard.stats.total_tokens;
+        stats.total_token_length += shard.stats.total_token_length;
+        stats.total_input_bytes += shard.stats.total_input_bytes;
     }
 
-    return true;
+    stats.total_unique_terms = static_cast<long long>(hash_table.size());
 }
 
+// Потоковая токенизация: принимает html кусками и держит недописанный
+// токен между кусками, не материализуя документ целиком
+struct StreamTokenizer {
+    IndexShard* shard = nullptr;
+    int doc_id = 0;
+    std::string pending; // хвост токена на границе кусков
+    int token_pos = 0;   // номер следующего токена в документе
 
-// Сохранение прямого индекса
-void save_forward(const char* fn) {
-    std::ofstream out(fn, std::ios::binary);
-    int doc_count = static_cast<int>(documents.size());
-    out.write(reinterpret_cast<const char*>(&doc_count), sizeof(int));
+    // Токены документа при дедупликации: решение принимается в конце
+    // документа, до него термы копятся здесь, а не в индексе
+    std::vector<std::string> buffered;
+    SimHash simhash;
+
+    void emit(std::string_view token) {
+        if (store_mode) {
+            // Потоковый режим однопоточный, пишем текст без блокировки
+            if ((int)doc_texts.size() <= doc_id) doc_texts.resize(doc_id + 1);
+            doc_texts[doc_id].append(token);
+            doc_texts[doc_id].push_back(' ');
+        }
+        if (should_skip_token(token)) return;
+        if (dedup_mode) {
+            simhash.add(token);
+            buffered.emplace_back(token);
+            return;
+        }
+        index_token(token);
+    }
+
+    void index_token(std::string_view token) {
+        if (bench_mode) {
+            unsigned long long t0 = bench_now();
+            const std::string& t = shard->stem_cache.stem_token(token);
+            unsigned long long t1 = bench_now();
+            add_term(*shard, t, doc_id, token_pos++);
+            bench.stem += t1 - t0;
+            bench.term_insert += bench_now() - t1;
+            shard->stats.total_tokens++;
+            shard->stats.total_token_length += t.size();
+            return;
+        }
+        const std::string& t = shard->stem_cache.stem_token(token);
+        add_term(*shard, t, doc_id, token_pos++);
+        shard->stats.total_tokens++;
+        shard->stats.total_token_length += t.size();
+    }
+
+    void feed(std::string_view chunk) {
+        if (bench_mode) {
+            unsigned long long t0 = bench_now();
+            feed_impl(chunk);
+            bench.tokenize += bench_now() - t0;
+            return;
+        }
+        feed_impl(chunk);
+    }
 
-    for (const auto& doc : documents) {
+    void feed_impl(std::string_view chunk) {
+        shard->stats.total_input_bytes += chunk.size();
+
+        const unsigned char* data =
+            reinterpret_cast<const unsigned char*>(chunk.data());
+        size_t n = chunk.size();
+        size_t i = 0;
+
+        if (!pending.empty()) {
+            size_t end = find_boundary(data, n, 0, false);
+            pending.append(chunk.data(), end);
+            if (end == n) return;
+            emit(pending);
+            pending.clear();
+            i = end;
+        }
+
+        while (i < n) {
+            size_t start = find_boundary(data, n, i, true);
+            if (start >= n) break;
+            size_t end = find_boundary(data, n, start, false);
+            if (end == n) {
+                pending.assign(chunk.data() + start, end - start);
+                break;
+            }
+            emit(std::string_view(chunk.data() + start, end - start));
+            i = end;
+        }
+    }
+
+    void finish() {
+        if (!pending.empty()) {
+            emit(pending);
+            pending.clear();
+        }
+        if (!dedup_mode) return;
+
+        // Конец документа: решаем, дубликат ли он, и только тогда
+        // пропускаем накопленные токены в индекс
+        if (register_fingerprint(doc_id, simhash) >= 0) {
+            if (store_mode && doc_id < (int)doc_texts.size()) {
+                doc_texts[doc_id].clear();
+            }
+        } else {
+            for (const auto& token : buffered) {
+                index_token(token);
+            }
+        }
+        buffered.clear();
+        simhash.reset();
+    }
+};
+
+// Убираем экранирование \" в небольших полях (url, oid)
+void unescape_quotes(std::string& s) {
+    size_t pos = 0;
+    while ((pos = s.find("\\\"", pos)) != std::string::npos) {
+        s.replace(pos, 2, "\"");
+        pos++;
+    }
+}
+
+// Двойная буферизация ввода: фоновый поток читает следующий кусок,
+// пока разбор идёт по текущему, так что диск и CPU работают внахлёст,
+// а не по очереди. Одного большого read в фоне хватает, чтобы занять
+// диск; io_uring дал бы то же самое ценой зависимости от liburing.
+// Работает и для файла, и для stdin — синхронный путь не нужен
+struct ChunkReader {
+    std::istream& in;
+    std::vector<char> bufs[2];
+    size_t lens[2] = {0, 0};
+    bool filled[2] = {false, false};
+    bool quit = false;
+    int cur = -1; // буфер, отданный потребителю
+    std::mutex mu;
+    std::condition_variable cv;
+    std::thread reader;
+
+    ChunkReader(std::istream& s, size_t chunk_size) : in(s) {
+        bufs[0].resize(chunk_size);
+        bufs[1].resize(chunk_size);
+        reader = std::thread([this] { run(); });
+    }
+
+    void run() {
+        int w = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                cv.wait(lock, [&] { return !filled[w] || quit; });
+                if (quit) return;
+            }
+
+            // Чтение без блокировки: этот буфер сейчас только наш
+            in.read(bufs[w].data(), bufs[w].size());
+            size_t n = static_cast<size_t>(in.gcount());
+
+            std::lock_guard<std::mutex> lock(mu);
+            lens[w] = n;
+            filled[w] = true;
+            cv.notify_all();
+            if (n == 0) return; // конец потока — пустой кусок как маркер
+            w ^= 1;
+        }
+    }
+
+    // Следующий заполненный кусок; предыдущий возвращается читателю.
+    // Пустой кусок означает конец потока
+    std::string_view next_chunk() {
+        std::unique_lock<std::mutex> lock(mu);
+        if (cur >= 0) {
+            filled[cur] = false;
+            cv.notify_all();
+        }
+        int nxt = (cur < 0) ? 0 : (cur ^ 1);
+        cv.wait(lock, [&] { return filled[nxt]; });
+        cur = nxt;
+        return std::string_view(bufs[cur].data(), lens[cur]);
+    }
+
+    ~ChunkReader() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            quit = true;
+            cv.notify_all();
+        }
+        reader.join();
+    }
+};
+
+// Потоковый разбор JSON-строк: один проход по буферу фиксированного
+// размера вместо getline и трёх сканов по строке. Поля распознаются по
+// ходу; html_content в последовательном режиме подаётся прямо в
+// токенизатор и не собирается в строку, так что память индексера не
+// зависит от размера страницы
+void ingest_stream(std::istream& in, std::vector<IndexShard>& shards, int num_workers) {
+    enum State { SCAN, KEY, AFTER_KEY, VALUE_START, STRING_VALUE };
+    State state = SCAN;
+    bool escape = false;
+
+    std::string key;
+    std::string value;          // собираемое строковое значение
+    bool capture = false;       // значение нужно сохранить в value
+    bool streaming = false;     // значение льётся в токенизатор
+
+    // Поля текущей записи
+    std::string url, oid, html;
+    bool have_html = false;
+
+    bool stream_html = (num_workers == 1);
+    StreamTokenizer tokenizer{&shards[0], 0, {}};
+    DocBatch batch;
+
+    // Куски по 4 МБ: читатель наполняет один, разбор идёт по другому
+    ChunkReader chunks(in, 4 << 20);
+
+    auto finish_record = [&]() {
+        if (have_html) {
+            Document doc;
+            doc.oid = oid;
+            doc.url = url;
+            doc.title = "Document " + std::to_string(stats.doc_count);
+            documents.push_back(doc);
+
+            std::cout << "\rProcessed document: " << stats.doc_count;
+
+            if (!stream_html) {
+                batch.docs.emplace_back(stats.doc_count, std::move(html));
+                if (batch.docs.size() >= BATCH_SIZE) {
+                    push_batch(std::move(batch));
+                    batch = DocBatch();
+                }
+            }
+            stats.doc_count++;
+        }
+        url.clear();
+        oid.clear();
+        html.clear();
+        have_html = false;
+    };
+
+    auto feed_start = std::chrono::steady_clock::now();
+    long long fed_bytes = 0;
+
+    while (true) {
+        std::string_view chunk = chunks.next_chunk();
+        const char* buf = chunk.data();
+        size_t n = chunk.size();
+        if (n == 0) break;
+
+        unsigned long long chunk_t0 = bench_mode ? bench_now() : 0;
+
+        size_t slice_start = 0; // начало несданного куска html в буфере
+        for (size_t i = 0; i < n; ++i) {
+            char c = buf[i];
+
+            switch (state) {
+                case SCAN:
+                    if (c == '"') {
+                        key.clear();
+                        escape = false;
+                        state = KEY;
+                    } else if (c == '\n') {
+                        finish_record();
+                    }
+                    break;
+
+                case KEY:
+                    if (escape) {
+                        key += c;
+                        escape = false;
+                    } else if (c == '\\') {
+                        escape = true;
+                    } else if (c == '"') {
+                        state = AFTER_KEY;
+                    } else {
+                        key += c;
+                    }
+                    break;
+
+                case AFTER_KEY:
+                    if (c == ':') {
+                        state = VALUE_START;
+                    } else if (!std::isspace(static_cast<unsigned char>(c))) {
+                        state = SCAN;
+                        i--; // байт может начинать новую запись/ключ
+                    }
+                    break;
+
+                case VALUE_START:
+                    if (c == '"') {
+                        capture = (key == "url" || key == "$oid");
+                        streaming = false;
+                        if (key == "html_content") {
+                            have_html = true;
+                            if (stream_html) {
+                                streaming = true;
+                                tokenizer.doc_id = stats.doc_count;
+                                tokenizer.token_pos = 0;
+                                slice_start = i + 1;
+                            } else {
+                                capture = true;
+                            }
+                        }
+                        value.clear();
+                        escape = false;
+                        state = STRING_VALUE;
+                    } else if (!std::isspace(static_cast<unsigned char>(c))) {
+                        // число / объект / массив — продолжаем сканировать
+                        state = SCAN;
+                        if (c == '"' || c == '\n') i--;
+                    }
+                    break;
+
+                case STRING_VALUE:
+                    if (escape) {
+                        escape = false;
+                    } else if (c == '\\') {
+                        escape = true;
+                    } else if (c == '"') {
+                        if (streaming) {
+                            tokenizer.feed(std::string_view(buf + slice_start,
+                                                            i - slice_start));
+                            tokenizer.finish();
+                        } else if (capture) {
+                            if (key == "url") { url = value; unescape_quotes(url); }
+                            else if (key == "$oid") { oid = value; unescape_quotes(oid); }
+                            else html = std::move(value);
+                        }
+                        state = SCAN;
+                        break;
+                    }
+                    if (state == STRING_VALUE && !streaming && capture) {
+                        value += c;
+                    }
+                    break;
+            }
+        }
+
+        // Хвост недочитанного html на границе буфера
+        if (state == STRING_VALUE && streaming && slice_start < n) {
+            tokenizer.feed(std::string_view(buf + slice_start, n - slice_start));
+        }
+
+        if (bench_mode) {
+            bench.ingest += bench_now() - chunk_t0;
+            fed_bytes += static_cast<long long>(n);
+            if (bench_rate_mb > 0) {
+                // Контролируемая скорость подачи: ждём, пока стена
+                // догонит объём, который положено было скормить
+                double target_sec = fed_bytes / (bench_rate_mb * 1024 * 1024);
+                std::this_thread::sleep_until(
+                    feed_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(target_sec)));
+            }
+        }
+    }
+
+    // Последняя запись без завершающего перевода строки
+    if (state == SCAN) {
+        finish_record();
+    }
+
+    if (!stream_html && !batch.docs.empty()) {
+        push_batch(std::move(batch));
+    }
+}
+
+
+// Дозапись сырых байт в буфер кодирования
+void write_bytes(std::vector<unsigned char>& out, const void* p, size_t n) {
+    const unsigned char* b = static_cast<const unsigned char*>(p);
+    out.insert(out.end(), b, b + n);
+}
+
+// Сохранение прямого индекса; doc_base/doc_limit задают срез
+// документов при шардировании (по умолчанию пишутся все).
+// Формат v2: "FIDX" + версия + doc_count, в каждой записи после
+// title/url/oid — alias (канонический doc_id почти дубликата, -1 для
+// обычных документов)
+void encode_forward(std::vector<unsigned char>& image,
+                    int doc_base = 0, int doc_limit = -1) {
+    int doc_count = (doc_limit >= 0) ? doc_limit
+                                     : static_cast<int>(documents.size());
+    write_bytes(image, "FIDX", 4);
+    int version = 2;
+    write_bytes(image, &version, sizeof(int));
+    write_bytes(image, &doc_count, sizeof(int));
+
+    for (int i = doc_base; i < doc_base + doc_count; ++i) {
+        const Document& doc = documents[i];
         int l = static_cast<int>(doc.title.size());
-        out.write(reinterpret_cast<const char*>(&l), sizeof(int));
-        out.write(doc.title.data(), l);
+        write_bytes(image, &l, sizeof(int));
+        write_bytes(image, doc.title.data(), l);
 
         l = static_cast<int>(doc.url.size());
-        out.write(reinterpret_cast<const char*>(&l), sizeof(int));
-        out.write(doc.url.data(), l);
+        write_bytes(image, &l, sizeof(int));
+        write_bytes(image, doc.url.data(), l);
 
         l = static_cast<int>(doc.oid.size());
-        out.write(reinterpret_cast<const char*>(&l), sizeof(int));
-        out.write(doc.oid.data(), l);
+        write_bytes(image, &l, sizeof(int));
+        write_bytes(image, doc.oid.data(), l);
+
+        // Ссылка дубликата на оригинал, в координатах среза
+        int alias = (i < (int)doc_aliases.size()) ? doc_aliases[i] : -1;
+        if (alias >= doc_base && alias < doc_base + doc_count) {
+            alias -= doc_base;
+        } else {
+            alias = -1;
+        }
+        write_bytes(image, &alias, sizeof(int));
     }
+}
+
+void save_forward(const char* fn, int doc_base = 0, int doc_limit = -1) {
+    std::vector<unsigned char> image;
+    encode_forward(image, doc_base, doc_limit);
 
+    std::ofstream out(fn, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(image.data()), image.size());
     out.close();
 }
 
-// Сохранение обратного индекса
-void save_inverted(const char* fn) {
-    std::ofstream out(fn, std::ios::binary);
-    long long total_terms = static_cast<long long>(hash_table.size());
-    out.write(reinterpret_cast<const char*>(&total_terms), sizeof(long long));
+// Хранилище документов: тексты конкатенируются в блоки по ~STORE_BLOCK
+// байт (документ целиком лежит в одном блоке) и сжимаются LZ-схемой в
+// духе LZ4: жадный поиск повторов по хеш-таблице 4-байтовых окон,
+// последовательность = токен-байт (старшие 4 бита — число литералов,
+// младшие — длина повтора минус 4, 15 — продолжение байтами по 255),
+// литералы, 2-байтовое смещение повтора назад; последняя
+// последовательность блока — только литералы. Зависимостей не нужно,
+// а декодер в движке — двадцать строк
+const int STORE_BLOCK = 64 << 10;
 
-    for (const auto& [term, entry] : hash_table) {
-        out.write(reinterpret_cast<const char*>(&entry->freq), sizeof(long long));
+void compress_block(const unsigned char* src, int n,
+                    std::vector<unsigned char>& out) {
+    const int HASH_BITS = 13;
+    std::vector<int> table(1 << HASH_BITS, -1);
 
-        int l = static_cast<int>(entry->term.size());
-        out.write(reinterpret_cast<const char*>(&l), sizeof(int));
-        out.write(entry->term.data(), l);
+    auto write_len = [&](int v) {
+        while (v >= 255) { out.push_back(255); v -= 255; }
+        out.push_back(static_cast<unsigned char>(v));
+    };
 
-        out.write(reinterpret_cast<const char*>(&entry->doc_count), sizeof(int));
+    int i = 0, lit_start = 0;
+    while (i + 4 <= n) {
+        unsigned int v;
+        std::memcpy(&v, src + i, 4);
+        unsigned int h = (v * 2654435761u) >> (32 - HASH_BITS);
+        int cand = table[h];
+        table[h] = i;
 
-        DocNode* n = entry->docs;
-        while (n) {
-            out.write(reinterpret_cast<const char*>(&n->doc_id), sizeof(int));
-            n = n->next;
+        if (cand < 0 || i - cand > 0xFFFF ||
+            std::memcmp(src + cand, src + i, 4) != 0) {
+            i++;
+            continue;
         }
+
+        int len = 4;
+        while (i + len < n && src[cand + len] == src[i + len]) len++;
+
+        int lit = i - lit_start;
+        int t_lit = std::min(lit, 15);
+        int t_match = std::min(len - 4, 15);
+        out.push_back(static_cast<unsigned char>((t_lit << 4) | t_match));
+        if (lit >= 15) write_len(lit - 15);
+        out.insert(out.end(), src + lit_start, src + i);
+
+        int off = i - cand;
+        out.push_back(off & 0xFF);
+        out.push_back((off >> 8) & 0xFF);
+        if (len - 4 >= 15) write_len(len - 4 - 15);
+
+        i += len;
+        lit_start = i;
+    }
+
+    // Хвост блока — последовательность из одних литералов
+    int lit = n - lit_start;
+    out.push_back(static_cast<unsigned char>(std::min(lit, 15) << 4));
+    if (lit >= 15) write_len(lit - 15);
+    out.insert(out.end(), src + lit_start, src + n);
+}
+
+// Формат docstore.idx:
+//   заголовок: magic "DSTR", version, doc_count, block_count
+//   таблица документов: doc_count * {int блок; int смещение в блоке;
+//                                    int длина текста}
+//   таблица блоков: block_count * {int64 смещение в файле;
+//                                  int сжатый размер; int сырой размер}
+//   сжатые блоки
+void encode_docstore(std::vector<unsigned char>& image,
+                     int doc_base = 0, int doc_limit = -1) {
+    int doc_count = (doc_limit >= 0) ? doc_limit
+                                     : static_cast<int>(documents.size());
+
+    struct DocEntry { int block; int offset; int length; };
+    struct BlockEntry { long long offset; int comp_bytes; int raw_bytes; };
+    std::vector<DocEntry> entries(doc_count);
+    std::vector<BlockEntry> blocks;
+
+    std::vector<unsigned char> raw;
+    std::vector<unsigned char> comp; // все сжатые блоки подряд
+    auto flush_block = [&]() {
+        size_t before = comp.size();
+        compress_block(raw.data(), static_cast<int>(raw.size()), comp);
+        blocks.push_back({static_cast<long long>(before),
+                          static_cast<int>(comp.size() - before),
+                          static_cast<int>(raw.size())});
+        raw.clear();
+    };
+
+    for (int i = 0; i < doc_count; ++i) {
+        static const std::string empty;
+        const std::string& text = (doc_base + i < (int)doc_texts.size())
+                                      ? doc_texts[doc_base + i] : empty;
+        entries[i] = {static_cast<int>(blocks.size()),
+                      static_cast<int>(raw.size()),
+                      static_cast<int>(text.size())};
+        raw.insert(raw.end(), text.begin(), text.end());
+        if (raw.size() >= (size_t)STORE_BLOCK) flush_block();
     }
+    if (!raw.empty()) flush_block();
+    int block_count = static_cast<int>(blocks.size());
 
+    // Смещения блоков становятся абсолютными по файлу
+    long long data_start = 4 + 3 * sizeof(int)
+                         + (long long)doc_count * sizeof(DocEntry)
+                         + (long long)block_count * sizeof(BlockEntry);
+    for (auto& b : blocks) b.offset += data_start;
+
+    write_bytes(image, "DSTR", 4);
+    int version = 1;
+    write_bytes(image, &version, sizeof(int));
+    write_bytes(image, &doc_count, sizeof(int));
+    write_bytes(image, &block_count, sizeof(int));
+    write_bytes(image, entries.data(), entries.size() * sizeof(DocEntry));
+    write_bytes(image, blocks.data(), blocks.size() * sizeof(BlockEntry));
+    write_bytes(image, comp.data(), comp.size());
+}
+
+void save_docstore(const char* fn, int doc_base = 0, int doc_limit = -1) {
+    std::vector<unsigned char> image;
+    encode_docstore(image, doc_base, doc_limit);
+
+    std::ofstream out(fn, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(image.data()), image.size());
     out.close();
 }
 
-// Сохранение CSV для закона Ципфа
-void save_zipf(const char* fn) {
-    std::ofstream out(fn);
-    out << "rank,term,frequency\n";
+// Варинт: младшие 7 бит в байте, старший бит — признак продолжения
+void write_varint(std::vector<unsigned char>& out, unsigned int v) {
+    while (v >= 0x80) {
+        out.push_back((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(v));
+}
+
+// Скип-запись: последний doc_id блока из SKIP_BLOCK постингов,
+// байтовое смещение блока от начала списка и максимальный tf блока —
+// верхняя граница вклада терма для WAND-отсечения в движке
+struct SkipEntry {
+    int last_doc;
+    int offset;
+    int max_tf;
+};
+
+const int SKIP_BLOCK = 128;
+
+// Словарь режется на блоки по DICT_BLOCK термов: первый терм блока
+// хранится целиком, остальные — общий префикс с предыдущим плюс хвост
+const int DICT_BLOCK = 16;
 
+// Сохранение обратного индекса.
+// Формат v7 рассчитан на mmap в движке:
+//   заголовок: magic "IIDX", version, term_count, flags
+//              (бит 0 — позиции), block_count, skips_start, postings_start
+//   таблица блоков: block_count * int64 — смещение каждого блока словаря
+//   словарь: блоки по DICT_BLOCK термов с фронт-кодированием — на терм
+//            варинт длины общего префикса с предыдущим термом (0 для
+//            первого в блоке), варинт длины хвоста, хвост, затем freq,
+//            doc_count, max_tf (верхняя граница для WAND),
+//            postings_offset, postings_bytes, skip_offset, skip_count;
+//            смещения относительны своих секций
+//   секция скипов: SkipEntry на каждый блок длинных списков
+//   секция постингов: на постинг — варинт зазора между возрастающими
+//                     doc_id и варинт tf; дельта сбрасывается на границе
+//                     блока, чтобы блок декодировался независимо.
+// При сборке с -DWITH_POSITIONS после tf каждого постинга идут tf
+// варинтов позиций токена (первая абсолютная, дальше дельты). Позиции
+// примерно удваивают индекс, поэтому это флаг сборки, а не опция запуска
+// doc_base/doc_limit задают диапазон doc_id при шардировании: в файл
+// попадают только постинги диапазона, doc_id перенумеровываются от
+// нуля, freq и doc_count пересчитываются по диапазону, термы без
+// постингов в диапазоне в словарь шарда не попадают
+// Результат кодирования непрерывного диапазона термов: постинги и
+// скипы партиции лежат в собственных буферах, смещения — локальные,
+// писатель сводит их префиксными суммами
+struct InvPartition {
+    std::vector<TermEntry*> terms; // термы, попавшие в диапазон
+    std::vector<unsigned char> encoded;
+    std::vector<SkipEntry> skips;
+    std::vector<long long> postings_offsets;
+    std::vector<int> postings_bytes;
+    std::vector<long long> skip_indexes;
+    std::vector<int> skip_counts;
+    std::vector<long long> freqs;
+    std::vector<int> doc_counts;
+    std::vector<int> max_tfs;
+};
+
+void encode_term_range(TermEntry* const* begin, TermEntry* const* end,
+                       int doc_base, int doc_limit, InvPartition& part) {
+    std::vector<DocNode*> postings;
+#ifdef WITH_POSITIONS
+    std::vector<int> positions;
+#endif
+    for (TermEntry* const* it = begin; it != end; ++it) {
+        TermEntry* entry = *it;
+        // Список строится prepend-ом, поэтому разворачиваем в возрастающий порядок
+        postings.clear();
+        for (DocNode* n = entry->docs; n; n = n->next) {
+            if (doc_limit >= 0 &&
+                (n->doc_id < doc_base || n->doc_id >= doc_base + doc_limit)) {
+                continue;
+            }
+            postings.push_back(n);
+        }
+        if (postings.empty()) continue; // терм не встречается в шарде
+        std::reverse(postings.begin(), postings.end());
+
+        part.terms.push_back(entry);
+        long long freq = 0;
+        int max_tf = 0;
+        for (DocNode* n : postings) {
+            freq += n->tf;
+            max_tf = std::max(max_tf, n->tf);
+        }
+        part.freqs.push_back(freq);
+        part.doc_counts.push_back(static_cast<int>(postings.size()));
+        part.max_tfs.push_back(max_tf);
+
+        size_t before = part.encoded.size();
+        part.postings_offsets.push_back(static_cast<long long>(before));
+
+        // Скипы пишем только для списков длиннее одного блока
+        bool with_skips = postings.size() > (size_t)SKIP_BLOCK;
+        part.skip_indexes.push_back(static_cast<long long>(part.skips.size()));
+        part.skip_counts.push_back(0);
+
+        int prev = 0;
+        for (size_t j = 0; j < postings.size(); ++j) {
+            if (j % SKIP_BLOCK == 0) {
+                prev = 0; // блок декодируется независимо
+                if (with_skips) {
+                    size_t last = std::min(j + SKIP_BLOCK, postings.size()) - 1;
+                    int block_max = 0;
+                    for (size_t q = j; q <= last; ++q) {
+                        block_max = std::max(block_max, postings[q]->tf);
+                    }
+                    part.skips.push_back({postings[last]->doc_id - doc_base,
+                                          static_cast<int>(part.encoded.size() - before),
+                                          block_max});
+                    part.skip_counts.back()++;
+                }
+            }
+            write_varint(part.encoded, postings[j]->doc_id - doc_base - prev);
+            write_varint(part.encoded, postings[j]->tf);
+            prev = postings[j]->doc_id - doc_base;
+#ifdef WITH_POSITIONS
+            // Позиции тоже накоплены prepend-ом — разворачиваем
+            positions.clear();
+            for (PosNode* pn = postings[j]->positions; pn; pn = pn->next) {
+                positions.push_back(pn->pos);
+            }
+            std::reverse(positions.begin(), positions.end());
+            int pprev = 0;
+            for (int pos : positions) {
+                write_varint(part.encoded, pos - pprev);
+                pprev = pos;
+            }
+#endif
+        }
+        part.postings_bytes.push_back(static_cast<int>(part.encoded.size() - before));
+    }
+}
+
+// Сборка полного образа inverted-файла в памяти. Кодирование списков
+// — самая дорогая часть сохранения — распараллелено по непрерывным
+// диапазонам термов; каждый терм кодируется независимо, а смещения
+// сводятся префиксными суммами, поэтому байты образа не зависят от
+// числа потоков
+void encode_inverted(std::vector<unsigned char>& image,
+                     int doc_base = 0, int doc_limit = -1) {
+    std::vector<TermEntry*> all_terms;
+    all_terms.reserve(hash_table.size());
+    for (auto& p : hash_table) all_terms.push_back(p.second);
+    std::sort(all_terms.begin(), all_terms.end(),
+              [](TermEntry* a, TermEntry* b){ return a->term < b->term; });
+
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads < 1) threads = 1;
+    if (threads > 8) threads = 8;
+    // На маленьком словаре потоки не окупаются
+    if (all_terms.size() < 4096) threads = 1;
+
+    std::vector<InvPartition> parts(threads);
+    {
+        std::vector<std::thread> pool;
+        size_t chunk = (all_terms.size() + threads - 1) / threads;
+        for (int t = 1; t < threads; ++t) {
+            size_t lo = std::min(t * chunk, all_terms.size());
+            size_t hi = std::min(lo + chunk, all_terms.size());
+            pool.emplace_back(encode_term_range,
+                              all_terms.data() + lo, all_terms.data() + hi,
+                              doc_base, doc_limit, std::ref(parts[t]));
+        }
+        encode_term_range(all_terms.data(),
+                          all_terms.data() + std::min(chunk, all_terms.size()),
+                          doc_base, doc_limit, parts[0]);
+        for (auto& th : pool) th.join();
+    }
+
+    // Склейка партиций: метаданные в общие массивы, локальные смещения
+    // сдвигаются на суммарные размеры предыдущих партиций
     std::vector<TermEntry*> terms;
-    for (auto &p : hash_table) terms.push_back(p.second);
+    std::vector<long long> postings_offsets;
+    std::vector<int> postings_bytes;
+    std::vector<long long> skip_indexes;
+    std::vector<int> skip_counts;
+    std::vector<long long> freqs;
+    std::vector<int> doc_counts;
+    std::vector<int> max_tfs;
+    long long encoded_total = 0, skips_total = 0;
+    for (auto& part : parts) {
+        for (size_t i = 0; i < part.terms.size(); ++i) {
+            terms.push_back(part.terms[i]);
+            postings_offsets.push_back(part.postings_offsets[i] + encoded_total);
+            postings_bytes.push_back(part.postings_bytes[i]);
+            skip_indexes.push_back(part.skip_indexes[i] + skips_total);
+            skip_counts.push_back(part.skip_counts[i]);
+            freqs.push_back(part.freqs[i]);
+            doc_counts.push_back(part.doc_counts[i]);
+            max_tfs.push_back(part.max_tfs[i]);
+        }
+        encoded_total += static_cast<long long>(part.encoded.size());
+        skips_total += static_cast<long long>(part.skips.size());
+    }
 
-    std::sort(terms.begin(), terms.end(),
-              [](TermEntry* a, TermEntry* b){ return b->freq < a->freq; });
+    long long term_count = static_cast<long long>(terms.size());
 
+    // Фронт-кодированный словарь собирается в памяти; смещения
+    // постингов и скипов пишутся относительно начала своих секций
+    std::vector<unsigned char> dict_buf;
+    std::vector<long long> block_offsets;
     for (size_t i = 0; i < terms.size(); ++i) {
-        out << (i+1) << "," << terms[i]->term << "," << terms[i]->freq << "\n";
+        const std::string& term = terms[i]->term;
+        size_t prefix = 0;
+        if (i % DICT_BLOCK == 0) {
+            block_offsets.push_back(static_cast<long long>(dict_buf.size()));
+        } else {
+            // Общий префикс с предыдущим термом
+            const std::string& prev = terms[i - 1]->term;
+            size_t max_p = std::min(prev.size(), term.size());
+            while (prefix < max_p && prev[prefix] == term[prefix]) prefix++;
+        }
+        write_varint(dict_buf, static_cast<unsigned int>(prefix));
+        write_varint(dict_buf, static_cast<unsigned int>(term.size() - prefix));
+        write_bytes(dict_buf, term.data() + prefix, term.size() - prefix);
+        write_bytes(dict_buf, &freqs[i], sizeof(long long));
+        write_bytes(dict_buf, &doc_counts[i], sizeof(int));
+        write_bytes(dict_buf, &max_tfs[i], sizeof(int));
+        write_bytes(dict_buf, &postings_offsets[i], sizeof(long long));
+        write_bytes(dict_buf, &postings_bytes[i], sizeof(int));
+        long long skip_off = skip_indexes[i] * (long long)sizeof(SkipEntry);
+        write_bytes(dict_buf, &skip_off, sizeof(long long));
+        write_bytes(dict_buf, &skip_counts[i], sizeof(int));
     }
+    int block_count = static_cast<int>(block_offsets.size());
+
+    // Считаем смещения секций; скипы выровнены на 4 байта
+    long long header_size = 4 + sizeof(int) + sizeof(long long)
+                          + 2 * sizeof(int) + 2 * sizeof(long long);
+    long long dict_start = header_size + (long long)block_count * sizeof(long long);
+    for (auto& off : block_offsets) off += dict_start;
+    long long dict_end = dict_start + (long long)dict_buf.size();
+    long long skips_start = (dict_end + 3) & ~3LL;
+    long long postings_start = skips_start + skips_total * (long long)sizeof(SkipEntry);
+
+    image.clear();
+    image.reserve(static_cast<size_t>(postings_start + encoded_total));
+
+    // Заголовок
+    write_bytes(image, "IIDX", 4);
+    int version = 8;
+#ifdef WITH_POSITIONS
+    int flags = 1;
+#else
+    int flags = 0;
+#endif
+    write_bytes(image, &version, sizeof(int));
+    write_bytes(image, &term_count, sizeof(long long));
+    write_bytes(image, &flags, sizeof(int));
+    write_bytes(image, &block_count, sizeof(int));
+    write_bytes(image, &skips_start, sizeof(long long));
+    write_bytes(image, &postings_start, sizeof(long long));
+
+    // Таблица блоков и словарь
+    write_bytes(image, block_offsets.data(),
+                block_offsets.size() * sizeof(long long));
+    write_bytes(image, dict_buf.data(), dict_buf.size());
+
+    image.resize(static_cast<size_t>(skips_start), 0); // выравнивание
+
+    // Скипы и постинги — склейка буферов партиций
+    for (const auto& part : parts) {
+        write_bytes(image, part.skips.data(),
+                    part.skips.size() * sizeof(SkipEntry));
+    }
+    for (const auto& part : parts) {
+        write_bytes(image, part.encoded.data(), part.encoded.size());
+    }
+}
+
+void save_inverted(const char* fn, int doc_base = 0, int doc_limit = -1) {
+    std::vector<unsigned char> image;
+    encode_inverted(image, doc_base, doc_limit);
+
+    std::ofstream out(fn, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(image.data()), image.size());
     out.close();
 }
 
+// Шардирование по диапазонам doc_id: --shards N режет корпус на N
+// примерно равных непрерывных диапазонов и раскладывает их по
+// каталогам shard_<i> с обычными forward.idx/inverted.idx (doc_id
+// внутри шарда начинаются с нуля). Манифест shards.idx перечисляет
+// шарды строками "<каталог> <база> <число документов>". Каждый каталог
+// — полноценный индекс: в нём можно запустить отдельный экземпляр
+// движка (engine --serve) и опрашивать их через координатор
+const char* SHARDS_FILE = "shards.idx";
 
+void save_shards(int num_shards) {
+    int total = static_cast<int>(documents.size());
+    std::ofstream manifest(SHARDS_FILE, std::ios::trunc);
 
-int main() {
+    int base = 0;
+    for (int s = 0; s < num_shards; ++s) {
+        // Остаток раздаём по одному документу первым шардам
+        int count = total / num_shards + (s < total % num_shards ? 1 : 0);
+        std::string dir = "shard_" + std::to_string(s);
+        mkdir(dir.c_str(), 0755);
+
+        save_forward((dir + "/forward.idx").c_str(), base, count);
+        save_inverted((dir + "/inverted.idx").c_str(), base, count);
+        if (store_mode) {
+            save_docstore((dir + "/docstore.idx").c_str(), base, count);
+        }
+        manifest << dir << " " << base << " " << count << "\n";
+        base += count;
+    }
+    manifest.close();
+}
+
+// Инкрементальные сегменты: манифест segments.idx перечисляет имена
+// сегментов (по строке на сегмент); сегмент N — файлы <имя>.fwd и
+// <имя>.inv в обычных форматах forward/inverted. doc_id сквозные:
+// каждый новый сегмент продолжает нумерацию предыдущих
+const char* MANIFEST_FILE = "segments.idx";
+
+std::vector<std::string> read_manifest() {
+    std::vector<std::string> names;
+    std::ifstream in(MANIFEST_FILE);
     std::string line;
-    clock_t start = clock();
+    while (std::getline(in, line)) {
+        if (!line.empty()) names.push_back(line);
+    }
+    return names;
+}
+
+// Число документов в сегменте — первый int его forward-файла
+int segment_doc_count(const std::string& name) {
+    std::ifstream in(name + ".fwd", std::ios::binary);
+    int count = 0;
+    in.read(reinterpret_cast<char*>(&count), sizeof(int));
+    return count;
+}
+
+// Имя следующего сегмента: seg_<максимальный номер + 1>
+std::string next_segment_name(const std::vector<std::string>& names) {
+    int max_n = 0;
+    for (const auto& name : names) {
+        size_t pos = name.rfind('_');
+        if (pos != std::string::npos) {
+            max_n = std::max(max_n, std::atoi(name.c_str() + pos + 1));
+        }
+    }
+    return "seg_" + std::to_string(max_n + 1);
+}
+
+// CSV для закона Ципфа. Сортировка по частоте распараллелена:
+// куски сортируются в потоках и сливаются при выводе; равные частоты
+// упорядочены по терму, так что файл не зависит от разбиения
+void encode_zipf(std::string& image) {
+    image += "rank,term,frequency\n";
+
+    std::vector<TermEntry*> terms;
+    terms.reserve(hash_table.size());
+    for (auto &p : hash_table) terms.push_back(p.second);
+
+    auto by_freq = [](TermEntry* a, TermEntry* b) {
+        if (a->freq != b->freq) return b->freq < a->freq;
+        return a->term < b->term;
+    };
+
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads < 1) threads = 1;
+    if (threads > 8) threads = 8;
+    if (terms.size() < 4096) threads = 1;
+
+    size_t chunk = (terms.size() + threads - 1) / threads;
+    std::vector<std::pair<size_t, size_t>> ranges; // [lo, hi) кусков
+    {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            size_t lo = std::min(t * chunk, terms.size());
+            size_t hi = std::min(lo + chunk, terms.size());
+            if (lo == hi) continue;
+            ranges.push_back({lo, hi});
+            pool.emplace_back([&terms, by_freq, lo, hi] {
+                std::sort(terms.begin() + lo, terms.begin() + hi, by_freq);
+            });
+        }
+        for (auto& th : pool) th.join();
+    }
+
+    // Слияние отсортированных кусков прямо в выходной буфер
+    std::vector<size_t> heads(ranges.size());
+    for (size_t i = 0; i < ranges.size(); ++i) heads[i] = ranges[i].first;
+    char line[64];
+    for (size_t rank = 1; ; ++rank) {
+        int best = -1;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            if (heads[i] == ranges[i].second) continue;
+            if (best < 0 || by_freq(terms[heads[i]], terms[heads[best]])) {
+                best = static_cast<int>(i);
+            }
+        }
+        if (best < 0) break;
+        TermEntry* e = terms[heads[best]++];
+        int n = std::snprintf(line, sizeof(line), "%zu,", rank);
+        image.append(line, n);
+        image += e->term;
+        n = std::snprintf(line, sizeof(line), ",%lld\n", e->freq);
+        image.append(line, n);
+    }
+}
+
+void save_zipf(const char* fn) {
+    std::string image;
+    encode_zipf(image);
+
+    std::ofstream out(fn, std::ios::binary);
+    out.write(image.data(), image.size());
+    out.close();
+}
+
+// Снимок одним файлом (--snapshot): секции forward/inverted/zipf
+// (и docstore при --store) лежат подряд, байт в байт совпадая с
+// содержимым отдельных файлов. В конце — каталог секций (тег,
+// смещение, длина) и трейлер фиксированного размера: смещение
+// каталога, число секций, версия, магия "SNAP". Секции кодируются
+// в память параллельно и пишутся несколькими большими write;
+// файл появляется под временным именем и переименовывается — читатель
+// никогда не увидит недописанный снимок
+const char* SNAPSHOT_FILE = "snapshot.idx";
+
+void save_snapshot(const char* fn) {
+    std::vector<unsigned char> fwd, inv, dstr;
+    std::string zpf;
+
+    std::thread t_fwd([&] { encode_forward(fwd); });
+    std::thread t_zpf([&] { encode_zipf(zpf); });
+    std::thread t_dstr;
+    if (store_mode) t_dstr = std::thread([&] { encode_docstore(dstr); });
+    encode_inverted(inv); // внутри распараллелен по термам
+    t_fwd.join();
+    t_zpf.join();
+    if (t_dstr.joinable()) t_dstr.join();
+
+    struct Section { const char* tag; const char* data; long long size; };
+    std::vector<Section> sections = {
+        {"FWD ", reinterpret_cast<const char*>(fwd.data()),
+         static_cast<long long>(fwd.size())},
+        {"INV ", reinterpret_cast<const char*>(inv.data()),
+         static_cast<long long>(inv.size())},
+        {"ZIPF", zpf.data(), static_cast<long long>(zpf.size())},
+    };
+    if (store_mode) {
+        sections.push_back({"DSTR", reinterpret_cast<const char*>(dstr.data()),
+                            static_cast<long long>(dstr.size())});
+    }
+
+    std::string tmp = std::string(fn) + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+
+    long long offset = 0;
+    std::vector<long long> offsets;
+    for (const auto& s : sections) {
+        offsets.push_back(offset);
+        out.write(s.data, s.size);
+        offset += s.size;
+    }
+
+    // Каталог секций и трейлер
+    long long dir_offset = offset;
+    for (size_t i = 0; i < sections.size(); ++i) {
+        out.write(sections[i].tag, 4);
+        out.write(reinterpret_cast<const char*>(&offsets[i]), sizeof(long long));
+        out.write(reinterpret_cast<const char*>(&sections[i].size), sizeof(long long));
+    }
+    int section_count = static_cast<int>(sections.size());
+    int version = 1;
+    out.write(reinterpret_cast<const char*>(&dir_offset), sizeof(long long));
+    out.write(reinterpret_cast<const char*>(&section_count), sizeof(int));
+    out.write(reinterpret_cast<const char*>(&version), sizeof(int));
+    out.write("SNAP", 4);
+    out.close();
+
+    std::rename(tmp.c_str(), fn);
+}
 
-    while (std::getline(std::cin, line)) {
-        std::string html, url, oid;
-        if (!extract(line, "html_content", html)) continue;
-        extract(line, "$oid", oid);
-        extract(line, "url", url);
 
+
+// Машиночитаемый отчёт бенчмарка: чистые такты каждой стадии
+// получаются вычитанием вложенных счётчиков
+void save_bench_report(const char* fn, double elapsed) {
+    unsigned long long tokenize = bench.tokenize - bench.stem - bench.term_insert;
+    unsigned long long json_extract = bench.ingest - bench.tokenize;
+    unsigned long long hash_insert = bench.term_insert - bench.posting_append;
+
+    std::ofstream out(fn);
+    out << "{"
+        << "\"documents\":" << documents.size() << ","
+        << "\"tokens\":" << stats.total_tokens << ","
+        << "\"input_bytes\":" << stats.total_input_bytes << ","
+        << "\"seconds\":" << elapsed << ","
+        << "\"mb_per_sec\":"
+        << (elapsed > 0 ? stats.total_input_bytes / (1024.0 * 1024.0) / elapsed : 0) << ","
+        << "\"rate_limit_mb\":" << bench_rate_mb << ","
+        << "\"cycles\":{"
+        << "\"json_extract\":" << json_extract << ","
+        << "\"tokenize\":" << tokenize << ","
+        << "\"stem\":" << bench.stem << ","
+        << "\"hash_insert\":" << hash_insert << ","
+        << "\"posting_append\":" << bench.posting_append << ","
+        << "\"serialize\":" << bench.serialize
+        << "}}\n";
+    out.close();
+}
+
+// Чтение варинта (обратное write_varint)
+unsigned int read_varint(const unsigned char*& p) {
+    unsigned int v = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        v |= static_cast<unsigned int>(*p & 0x7F) << shift;
+        shift += 7;
+        p++;
+    }
+    v |= static_cast<unsigned int>(*p) << shift;
+    p++;
+    return v;
+}
+
+// Чтение forward-файла сегмента с дозаписью в documents
+bool load_segment_forward(const std::string& name) {
+    std::ifstream in(name + ".fwd", std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open " << name << ".fwd\n";
+        return false;
+    }
+
+    // v2 начинается с магии "FIDX", старый формат — сразу с doc_count
+    int version = 1;
+    char magic[4];
+    in.read(magic, 4);
+    if (std::memcmp(magic, "FIDX", 4) == 0) {
+        in.read(reinterpret_cast<char*>(&version), sizeof(int));
+    } else {
+        in.seekg(0);
+    }
+
+    int doc_count;
+    in.read(reinterpret_cast<char*>(&doc_count), sizeof(int));
+
+    int doc_base = static_cast<int>(documents.size());
+    for (int i = 0; i < doc_count; ++i) {
         Document doc;
-        doc.oid = oid;
-        doc.url = url;
-        doc.title = "Document " + std::to_string(stats.doc_count);
+        int l;
+        in.read(reinterpret_cast<char*>(&l), sizeof(int));
+        doc.title.resize(l);
+        in.read(doc.title.data(), l);
+        in.read(reinterpret_cast<char*>(&l), sizeof(int));
+        doc.url.resize(l);
+        in.read(doc.url.data(), l);
+        in.read(reinterpret_cast<char*>(&l), sizeof(int));
+        doc.oid.resize(l);
+        in.read(doc.oid.data(), l);
+        if (version >= 2) {
+            int alias;
+            in.read(reinterpret_cast<char*>(&alias), sizeof(int));
+            if (alias >= 0) {
+                doc_aliases.resize(doc_base + i + 1, -1);
+                doc_aliases[doc_base + i] = doc_base + alias;
+            }
+        }
         documents.push_back(doc);
+    }
+    return true;
+}
 
-        std::cout << "\rProcessed document: " << stats.doc_count;
+// Чтение inverted-файла сегмента обратно в hash_table (для компактации).
+// Сегменты читаются в порядке манифеста, то есть doc_id по возрастанию,
+// поэтому prepend в add_doc-овском стиле сохраняет убывающий порядок
+bool load_segment_inverted(const std::string& name) {
+    std::ifstream in(name + ".inv", std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::cerr << "Cannot open " << name << ".inv\n";
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(in.tellg());
+    in.seekg(0);
+    std::vector<unsigned char> buf(size);
+    in.read(reinterpret_cast<char*>(buf.data()), size);
+
+    if (size < 16 || std::memcmp(buf.data(), "IIDX", 4) != 0) {
+        std::cerr << "Bad segment format: " << name << ".inv\n";
+        return false;
+    }
 
-        process_html(html, stats.doc_count);
-        stats.doc_count++;
+    int version;
+    std::memcpy(&version, buf.data() + 4, sizeof(int));
+    if (version != 8) {
+        std::cerr << "Unsupported segment version " << version
+                  << " in " << name << ".inv\n";
+        return false;
     }
 
-    clock_t end = clock();
-    double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
+    long long term_count;
+    int flags, block_count;
+    long long postings_start;
+    std::memcpy(&term_count, buf.data() + 8, sizeof(long long));
+    std::memcpy(&flags, buf.data() + 16, sizeof(int));
+    std::memcpy(&block_count, buf.data() + 20, sizeof(int));
+    std::memcpy(&postings_start, buf.data() + 32, sizeof(long long));
+    bool has_positions = (flags & 1);
+#ifndef WITH_POSITIONS
+    if (has_positions) {
+        // Компактация без позиций потеряла бы их — требуем ту же сборку
+        std::cerr << "Segment " << name << " has positions; "
+                  << "rebuild indexer with -DWITH_POSITIONS to compact it\n";
+        return false;
+    }
+#endif
 
-    save_forward("forward.idx");
-    save_inverted("inverted.idx");
-    save_zipf("zipf.csv");
+    // Словарь читается подряд: фронт-кодированный терм
+    // восстанавливается из общего префикса с предыдущим
+    const unsigned char* p = buf.data() + 40 + (long long)block_count * sizeof(long long);
+    std::string term;
+    for (long long i = 0; i < term_count; ++i) {
+        unsigned int prefix = read_varint(p);
+        unsigned int suffix = read_varint(p);
+        term.resize(prefix);
+        term.append(reinterpret_cast<const char*>(p), suffix);
+        p += suffix;
 
+        long long freq;
+        int doc_count;
+        std::memcpy(&freq, p, sizeof(long long));
+        p += sizeof(long long);
+        std::memcpy(&doc_count, p, sizeof(int));
+        p += sizeof(int);
+        p += sizeof(int); // max_tf пересчитается при сохранении
+        long long postings_offset;
+        std::memcpy(&postings_offset, p, sizeof(long long));
+        p += sizeof(long long) + sizeof(int)           // postings_offset, postings_bytes
+           + sizeof(long long) + sizeof(int);          // skip_offset, skip_count
 
-    std::cout << "Documents: " << stats.doc_count << "\n";
+        TermEntry* e;
+        auto it = hash_table.find(term);
+        if (it != hash_table.end()) {
+            e = it->second;
+        } else {
+            e = new (merge_arena.alloc(sizeof(TermEntry), alignof(TermEntry))) TermEntry();
+            e->term = term;
+            // Ключ должен смотреть на байты в TermEntry, а не на
+            // переиспользуемый буфер term
+            hash_table[std::string_view(e->term)] = e;
+        }
+        e->freq += freq;
+
+        const unsigned char* q = buf.data() + postings_start + postings_offset;
+        int doc_id = 0;
+        for (int j = 0; j < doc_count; ++j) {
+            if (j % SKIP_BLOCK == 0) doc_id = 0;
+            doc_id += read_varint(q);
+            int tf = static_cast<int>(read_varint(q));
+            DocNode* n = new (merge_arena.alloc(sizeof(DocNode), alignof(DocNode)))
+                DocNode{doc_id, tf, e->docs};
+#ifdef WITH_POSITIONS
+            // Позиции читаются по возрастанию — prepend снова даёт
+            // тот же обратный порядок, что и add_doc
+            if (has_positions) {
+                int pos = 0;
+                for (int k = 0; k < tf; ++k) {
+                    pos += read_varint(q);
+                    n->positions = new (merge_arena.alloc(sizeof(PosNode), alignof(PosNode)))
+                        PosNode{pos, n->positions};
+                }
+            }
+#endif
+            e->docs = n;
+            e->doc_count++;
+        }
+    }
+    return true;
+}
+
+// Компактация: сливает все сегменты манифеста в один новый сегмент
+// и удаляет старые. Запускается отдельно (например, по крону), пока
+// основной индексер пишет следующие сегменты
+int run_compact() {
+    std::vector<std::string> names = read_manifest();
+    if (names.size() <= 1) {
+        std::cout << "Nothing to compact: " << names.size() << " segment(s)\n";
+        return 0;
+    }
+
+    for (const auto& name : names) {
+        if (!load_segment_forward(name) || !load_segment_inverted(name)) {
+            return 1;
+        }
+    }
+
+    std::string merged = next_segment_name(names);
+    save_forward((merged + ".fwd").c_str());
+    save_inverted((merged + ".inv").c_str());
+
+    std::ofstream manifest(MANIFEST_FILE, std::ios::trunc);
+    manifest << merged << "\n";
+    manifest.close();
+
+    for (const auto& name : names) {
+        std::remove((name + ".fwd").c_str());
+        std::remove((name + ".inv").c_str());
+    }
+
+    std::cout << "Compacted " << names.size() << " segments into " << merged
+              << " (" << documents.size() << " documents, "
+              << hash_table.size() << " terms)\n";
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // indexer [N] [--segment | --compact | --shards N | --store | --bench <корпус> [МБ/с]]:
+    //   N          — число воркеров (по умолчанию последовательный режим)
+    //   --segment  — дописать новый сегмент вместо полной пересборки
+    //   --compact  — слить сегменты манифеста в один
+    //   --shards   — разложить корпус на N шардов по диапазонам doc_id
+    //   --store    — дополнительно сохранить тексты документов
+    //                (docstore.idx) для сниппетов в движке
+    //   --dedup    — не индексировать почти одинаковые документы
+    //                (SimHash), дубликаты ссылаются на оригинал
+    //   --snapshot — вместо отдельных файлов записать единый
+    //                snapshot.idx с каталогом секций в конце
+    //   --bench    — проиграть корпус из файла с замером стадий
+    //                (опционально с ограничением скорости подачи)
+    int num_workers = 1;
+    bool segment_mode = false;
+    bool snapshot_mode = false;
+    int num_doc_shards = 0;
+    const char* bench_file = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--segment") segment_mode = true;
+        else if (arg == "--store") store_mode = true;
+        else if (arg == "--dedup") dedup_mode = true;
+        else if (arg == "--snapshot") snapshot_mode = true;
+        else if (arg == "--shards" && i + 1 < argc) {
+            num_doc_shards = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--compact") return run_compact();
+        else if (arg == "--bench" && i + 1 < argc) {
+            bench_mode = true;
+            bench_file = argv[++i];
+            if (i + 1 < argc && std::atof(argv[i + 1]) > 0) {
+                bench_rate_mb = std::atof(argv[++i]);
+            }
+        }
+        else num_workers = std::max(1, std::atoi(argv[i]));
+    }
+
+    if (bench_mode) num_workers = 1; // счётчики стадий без синхронизации
+
+    auto start = std::chrono::steady_clock::now();
+
+    // В сегментном режиме продолжаем сквозную нумерацию документов
+    std::vector<std::string> manifest_names;
+    if (segment_mode) {
+        manifest_names = read_manifest();
+        int base = 0;
+        for (const auto& name : manifest_names) {
+            base += segment_doc_count(name);
+        }
+        stats.doc_count = base;
+    }
+
+    std::vector<IndexShard> shards(num_workers);
+    std::vector<std::thread> workers;
+    if (num_workers > 1) {
+        for (int i = 0; i < num_workers; ++i) {
+            workers.emplace_back(worker_main, &shards[i]);
+        }
+    }
+
+    if (bench_mode) {
+        std::ifstream bench_in(bench_file, std::ios::binary);
+        if (!bench_in) {
+            std::cerr << "Cannot open corpus file: " << bench_file << "\n";
+            return 1;
+        }
+        ingest_stream(bench_in, shards, num_workers);
+    } else {
+        ingest_stream(std::cin, shards, num_workers);
+    }
+
+    if (num_workers > 1) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            input_done = true;
+        }
+        queue_cv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    merge_shards(shards);
+
+    auto end = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(end - start).count();
+
+    if (segment_mode) {
+        // Новый неизменяемый сегмент + запись в манифест
+        std::string name = next_segment_name(manifest_names);
+        save_forward((name + ".fwd").c_str());
+        save_inverted((name + ".inv").c_str());
+
+        std::ofstream manifest(MANIFEST_FILE, std::ios::app);
+        manifest << name << "\n";
+
+        std::cout << "Segment: " << name << "\n";
+    } else if (num_doc_shards > 0) {
+        save_shards(num_doc_shards);
+        std::cout << "Shards: " << num_doc_shards
+                  << " (manifest " << SHARDS_FILE << ")\n";
+    } else if (snapshot_mode) {
+        unsigned long long t0 = bench_mode ? bench_now() : 0;
+        save_snapshot(SNAPSHOT_FILE);
+        if (bench_mode) bench.serialize += bench_now() - t0;
+        std::cout << "Snapshot: " << SNAPSHOT_FILE << "\n";
+    } else {
+        unsigned long long t0 = bench_mode ? bench_now() : 0;
+        save_forward("forward.idx");
+        save_inverted("inverted.idx");
+        if (store_mode) save_docstore("docstore.idx");
+        save_zipf("zipf.csv");
+        if (bench_mode) bench.serialize += bench_now() - t0;
+    }
+
+    if (bench_mode) {
+        double total = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        save_bench_report("bench.json", total);
+        std::cout << "Benchmark report: bench.json\n";
+    }
+
+    std::cout << "Documents: " << documents.size() << "\n";
+    if (dedup_mode) {
+        int dups = 0;
+        for (int a : doc_aliases) {
+            if (a >= 0) dups++;
+        }
+        std::cout << "Duplicates aliased: " << dups << "\n";
+    }
     std::cout << "Unique terms: " << stats.total_unique_terms << "\n";
     std::cout << "Total tokens: " << stats.total_tokens << "\n";
     std::cout << "Avg token length: "